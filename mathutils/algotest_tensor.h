@@ -19,12 +19,84 @@
 #define algotest_tensor_included
 
 #include <algorithm>
+#include <atomic>
+#include <limits>
+#include <random>
+#include <utility>
 #include "algotest_tensor_strided_shape.h"
 #include "algotest_memory.h"
+#include "algotest_tensor_memory.h"
+#include "algotest_tensor_gemm.h"
 #include "cnpy.h"
 
 namespace algotest
 {
+    /// Buffer of a copy-on-write vtensor. It is shared by all lazy copies of the same values
+    template<class T>
+    struct cow_buffer
+    {
+        std::shared_ptr<AbstractData> m_holder;
+        T * m_base;                         // the lowest address used by the tensor
+        tensor_settings::index_type m_size; // number of elements starting from m_base
+    };
+    
+    /// Data holder of a copy-on-write vtensor. It is shared by all views of one value,
+    /// so a private copy made on write becomes visible to all these views at once.
+    template<class T>
+    class CowData : public AbstractData
+    {
+    public:
+        std::shared_ptr< cow_buffer<T> > m_buffer;
+    public:
+        CowData(std::shared_ptr< cow_buffer<T> > buffer) : m_buffer( std::move(buffer) ) {}
+        
+        bool isShared() const { return m_buffer.use_count()>1; }
+        
+        void detach()
+        {
+            const cow_buffer<T>& b = *m_buffer;
+            std::shared_ptr<AbstractData> holder;
+            T * data = huge_page_memory::allocate<T>(b.m_size, holder);
+            std::copy(b.m_base, b.m_base + b.m_size, data);
+            m_buffer = std::make_shared< cow_buffer<T> >( cow_buffer<T>{ holder, data, b.m_size } );
+        }
+    };
+    
+    /// type used to accumulate statistics of values of type T
+    template<class T> struct tensor_accumulator { typedef T type; };
+    template<> struct tensor_accumulator<half> { typedef float type; };
+    
+    /// running count, mean and sum of squared deviations (Welford), partial states are merged by Chan's formula
+    template<class A>
+    struct welford_state
+    {
+        tensor_settings::index_type m_n = 0;
+        A m_mean = 0;
+        A m_m2 = 0;
+        
+        void add(const A& x)
+        {
+            ++m_n;
+            A d = x - m_mean;
+            m_mean += d/A(m_n);
+            m_m2 += d*(x - m_mean);
+        }
+        
+        void merge(const welford_state& o)
+        {
+            if (o.m_n==0) return;
+            tensor_settings::index_type n = m_n + o.m_n;
+            A d = o.m_mean - m_mean;
+            m_mean += d*A(o.m_n)/A(n);
+            m_m2 += o.m_m2 + d*d*A(m_n)*A(o.m_n)/A(n);
+            m_n = n;
+        }
+    };
+    
+    // tensor<T> has dynamic shape, tensor<T,N> and tensor<T,N,M> are fixed-size vectors and matrices
+    // allocated in place (see algotest_tensor_fixed.h)
+    template<class T, int... Dims> class tensor;
+    
     // vtensor represents tensor with "value" semantics were assignment operator copies values, not a reference
     // use vtensor<const T> for vtensor of constants
     template<class T>
@@ -39,6 +111,10 @@ namespace algotest
         /// Shared data
         std::shared_ptr<AbstractData> m_data_holder;
         T * m_data;
+        
+        /// Copy-on-write state, it is empty if copy-on-write mode is off
+        std::shared_ptr< CowData<T> > m_cow;
+        index_type m_cow_offset = 0;    // displacement of the data from the copy-on-write buffer base
     public:
         // this field is protected from modifications by "const" semantics of it's public methods
         const_tensor_strided_shape shape;   // m_ is omitted because shape is a standard field in NumPy
@@ -47,7 +123,7 @@ namespace algotest
         strided_array_ptr<T> strided_ptr() const
         {
             ASSERT(m_data!=0);
-            return strided_array_ptr<T>(m_data,
+            return strided_array_ptr<T>(data(),
                                         shape.shape_ptr(),
                                         shape.stride_ptr(),
                                         shape.ndim() );
@@ -58,8 +134,47 @@ namespace algotest
         {
             m_data = a.m_data;
             m_data_holder = a.m_data_holder;
+            m_cow = a.m_cow;
+            m_cow_offset = a.m_cow_offset;
             shape = a.shape;
         }
+        
+        /// creates a tensor that references the same data
+        vtensor makeView(const tensor_strided_shape& ss, index_type displace = 0) const
+        {
+            vtensor res(ss, data() + displace, m_data_holder);
+            res.m_cow = m_cow;
+            res.m_cow_offset = m_cow_offset + displace;
+            return res;
+        }
+        
+        /// makes a private copy of the copy-on-write buffer before modification if the buffer is shared
+        void prepareWrite() { detachShared(); }
+        
+        /// prepareWrite() for tensors modified through const methods (this tensor or arguments of apply)
+        void detachShared() const
+        {
+            if constexpr (!std::is_const_v<T>)
+            {
+                if (m_cow && m_cow->isShared()) m_cow->detach();
+            }
+        }
+        
+        /// detaches this tensor and arguments a, b of apply if op takes them by non-const reference
+        template<class OP, class U>
+        void detachModified(const vtensor<U>& a) const
+        {
+            if constexpr (!std::is_invocable_v<OP&, const T&, U&>) detachShared();
+            if constexpr (!std::is_invocable_v<OP&, T&, const U&>) a.detachShared();
+        }
+        
+        template<class OP, class U, class V>
+        void detachModified(const vtensor<U>& a, const vtensor<V>& b) const
+        {
+            if constexpr (!std::is_invocable_v<OP&, const T&, U&, V&>) detachShared();
+            if constexpr (!std::is_invocable_v<OP&, T&, const U&, V&>) a.detachShared();
+            if constexpr (!std::is_invocable_v<OP&, T&, U&, const V&>) b.detachShared();
+        }
 
     public:
         vtensor() : m_data(0) {}
@@ -67,8 +182,7 @@ namespace algotest
         vtensor(vtensor&&) = default;
         vtensor(const tensor_shape& shape) : shape(shape)
         {
-            m_data = new T[shape.numElements()];
-            m_data_holder = abstractDataHolder(ArrayPtr<T>(m_data));
+            m_data = huge_page_memory::allocate<T>(shape.numElements(), m_data_holder);
         }
         vtensor(const tensor_strided_shape& shape, T* data, std::shared_ptr<AbstractData> data_holder)
             : shape(shape), m_data(data), m_data_holder(data_holder)
@@ -95,30 +209,43 @@ namespace algotest
         
         operator vtensor<const T>() const
         {
-            return vtensor<const T>(shape, m_data, m_data_holder);
+            return vtensor<const T>(shape, data(), dataHolder());
         }
         
-        T& operator[](const tensor_index& index) { return m_data[shape.getDisplace(index)]; }
-        const T& operator[](const tensor_index& index) const { return m_data[shape.getDisplace(index)]; }
+        T& operator[](const tensor_index& index) { return data()[shape.getDisplace(index)]; }
+        const T& operator[](const tensor_index& index) const { return data()[shape.getDisplace(index)]; }
         
         // Use ref for fast indexing (though indexing is not so fast as othe access methods)
         template<size_t N>
-        T& ref(const std::array<index_type, N>& index) { return m_data[shape.getDisplaceC(index)]; }
+        T& ref(const std::array<index_type, N>& index) { return data()[shape.getDisplaceC(index)]; }
 
         // Use ref for fast indexing (though indexing is not so fast as othe access methods)
         template<size_t N>
-        const T& ref(const std::array<index_type, N>& index) const { return m_data[shape.getDisplaceC(index)]; }
+        const T& ref(const std::array<index_type, N>& index) const { return data()[shape.getDisplaceC(index)]; }
         
         // Use ref for fast indexing (though indexing is not so fast as othe access methods)
         template<tensor_index_type_class... C>
         const T& ref(C... index) const
         {
             std::array<index_type, sizeof...(index) > arr{ index... };
-            return m_data[shape.getDisplaceC(arr)];
+            return data()[shape.getDisplaceC(arr)];
         }
         
-        T* data() const { return m_data; }
-        std::shared_ptr<AbstractData> dataHolder() const { return m_data_holder; }
+        /// data for reading: writes through this pointer bypass copy-on-write and are seen by all copies
+        T* data() const { return m_cow ? m_cow->m_buffer->m_base + m_cow_offset : m_data; }
+        
+        /// non-const access to data is treated as modification of a copy-on-write tensor,
+        /// read via std::as_const(t).data() to keep the data shared
+        T* data() { prepareWrite(); return std::as_const(*this).data(); }
+        
+        /// value of a tensor with a single element (e.g. a full reduction)
+        const T& item() const
+        {
+            ASSERT(numElements()==1);
+            return *data();
+        }
+        
+        std::shared_ptr<AbstractData> dataHolder() const { return m_cow ? m_cow->m_buffer->m_holder : m_data_holder; }
         int numElements() const { return shape.numElements(); }
         int ndim() const { return shape.ndim(); }
         bool isSequential() const { return shape.isSequential(); }
@@ -134,7 +261,7 @@ namespace algotest
         /// It is too slow for production.
         tensor_index referenceToIndex(const T& ref) const
         {
-            return shape.displaceToIndex( index_type(&ref - m_data) );
+            return shape.displaceToIndex( index_type(&ref - data()) );
         }
         
         bool canReshapeTo(const tensor_shape& other_shape) const
@@ -143,13 +270,13 @@ namespace algotest
         }
         vtensor reshape(const tensor_shape& other_shape) const
         {
-            return vtensor(shape.copy().reshape(other_shape), m_data, m_data_holder);
+            return makeView(shape.copy().reshape(other_shape));
         }
         
         vtensor upshape(const tensor_shape& other_shape) const
         {
             if (other_shape.isPrefixOf(shape)) return *this;
-            return vtensor(shape.copy().upshape(other_shape), m_data, m_data_holder);
+            return makeView(shape.copy().upshape(other_shape));
         }
         
         template<tensor_index_type_class... C>
@@ -167,42 +294,42 @@ namespace algotest
         */
         vtensor destroyAxis(int axis, index_type select_index = 0) const
         {
-            return vtensor(shape.copy().destroyAxis(axis), m_data + stride(axis)*select_index, m_data_holder);
+            return makeView(shape.copy().destroyAxis(axis), stride(axis)*select_index);
         }
         vtensor subtensor(const tensor_index& index) const
         {
             ASSERT(index.ndim() <= ndim());
-            return vtensor(shape.stridedTail(ndim() - index.ndim()), m_data + getDisplace(index), m_data_holder);
+            return makeView(shape.stridedTail(ndim() - index.ndim()), getDisplace(index));
         }
         vtensor trim(const tensor_index& index) const
         {
             tensor_strided_shape ss = shape;
             ss.trim(index);
-            return vtensor(ss, m_data, m_data_holder);
+            return makeView(ss);
         }
         vtensor trimTail(const tensor_index& index) const
         {
             tensor_strided_shape ss = shape;
             ss.trimTail(index);
-            return vtensor(ss, m_data, m_data_holder);
+            return makeView(ss);
         }
         vtensor trimStart(const tensor_index& index) const
         {
             tensor_strided_shape ss = shape;
             ss.trimTail(index);
-            return vtensor(ss, m_data+getDisplace(index), m_data_holder);
+            return makeView(ss, getDisplace(index));
         }
         vtensor crop(const tensor_index& begin, const tensor_index& end) const
         {
             tensor_strided_shape ss = shape;
             ss.crop(begin, end);
-            return vtensor(ss, m_data+getDisplace(begin), m_data_holder);
+            return makeView(ss, getDisplace(begin));
         }
         vtensor crop_size(const tensor_index& begin, const tensor_index& size) const
         {
             tensor_strided_shape ss = shape;
             ss.crop_size(begin, size);
-            return vtensor(ss, m_data+getDisplace(begin), m_data_holder);
+            return makeView(ss, getDisplace(begin));
         }
         
         vtensor slice( const std::initializer_list<index_slice>& s ) const
@@ -210,7 +337,7 @@ namespace algotest
             tensor_strided_shape ss = shape;
             index_type d = 0;
             ss.slice(s, d);
-            return vtensor(ss, m_data+d, m_data_holder);
+            return makeView(ss, d);
         }
         
         // convert axis into 2 axes
@@ -218,14 +345,14 @@ namespace algotest
         {
             tensor_strided_shape ss = shape;
             ss.splitAxis(axis, num_parts);
-            return vtensor(ss, m_data, m_data_holder);
+            return makeView(ss);
         }
         
         vtensor sliceAxis(int axis, index_type begin, index_type end, index_type step) const
         {
             tensor_strided_shape ss = shape;
             ss.sliceAxis(axis, begin, end, step);
-            return vtensor(ss, m_data+shape.getDisplaceByAxis(axis, begin), m_data_holder);
+            return makeView(ss, shape.getDisplaceByAxis(axis, begin));
         }
         vtensor cropAxis(int axis, index_type begin, index_type end) const
         {
@@ -236,7 +363,7 @@ namespace algotest
         // leave all other axes untouched
         vtensor permute(const std::vector<int>& axes) const
         {
-            return vtensor(shape.copy().permuteAxes(axes), m_data, m_data_holder);
+            return makeView(shape.copy().permuteAxes(axes));
         }
         
         template<tensor_index_type_class... C>
@@ -247,7 +374,7 @@ namespace algotest
         
         vtensor swapAxes(int axis1, int axis2) const
         {
-            return vtensor(shape.copy().swapAxes(axis1, axis2), m_data, m_data_holder);
+            return makeView(shape.copy().swapAxes(axis1, axis2));
         }
         
         // matrix transposition
@@ -266,13 +393,21 @@ namespace algotest
         // select some axes and destroy other
         vtensor selectAxes(const std::vector<int>& axes) const
         {
-            return vtensor(shape.copy().selectAxes(axes), m_data, m_data_holder);
+            return makeView(shape.copy().selectAxes(axes));
+        }
+        
+        /// view of the diagonal of two axes of equal size, the diagonal stays in place of axis1, axis2 is removed
+        vtensor diagonal(int axis1, int axis2) const
+        {
+            makeAxisIndexPositive(axis1);
+            makeAxisIndexPositive(axis2);
+            return makeView(shape.copy().diagonal(axis1, axis2));
         }
         
         /// make some axis reverted
         vtensor flip(int axis) const
         {
-            return vtensor(shape.copy().flip(axis), m_data + stride(axis)*(shape[axis]-1), m_data_holder);
+            return makeView(shape.copy().flip(axis), stride(axis)*(shape[axis]-1));
         }
         
         vtensor<T> index_select(int axis, const tensor_index& indices) const
@@ -298,49 +433,149 @@ namespace algotest
         // The data is not copied, replicated values reference the same memory
         vtensor<T> replicateValues(const tensor_shape& s) const
         {
-            return vtensor( shape.copy().insertAxes(shape.ndim(), s), m_data, m_data_holder);
+            return makeView(shape.copy().insertAxes(shape.ndim(), s));
         }
         /// insert several axes with 0-stride (it means that pointed data is repeated )
         vtensor<T> insertAxes(int axis_index, const tensor_shape& s) const
         {
-            return vtensor( shape.copy().insertAxes(axis_index, s), m_data, m_data_holder);
+            return makeView(shape.copy().insertAxes(axis_index, s));
         }
         /// insert one axis with 0-stride (it means that pointed data is repeated along this axis)
         vtensor<T> insertAxis(int axis_index, index_type count) const
         {
-            return vtensor( shape.copy().insertAxes(axis_index, {count}), m_data, m_data_holder);
+            return makeView(shape.copy().insertAxes(axis_index, {count}));
         }
 
-        void init(const T& val) { strided_ptr().init(val); }
+        void init(const T& val) { prepareWrite(); strided_ptr().init(val); }
         
-        template<class OP> void apply(OP&& op) const { strided_ptr().apply(op); }
+        // apply functions may modify values of this tensor and of the arguments (when op takes them by
+        // non-const reference), so copy-on-write tensors modified by op get private data before the walk
+        template<class OP> void apply(OP&& op) const
+        {
+            if constexpr (!std::is_invocable_v<OP&, const T&>) detachShared();
+            strided_ptr().apply(op);
+        }
         
         template<class U, class OP2>
         void apply(const vtensor<U>& a, OP2&& op) const
         {
+            detachModified<OP2>(a);
             strided_ptr().apply(a.strided_ptr(), op);
         }
         
         template<class U, class V, class OP3>
         void apply(const vtensor<U>& a, const vtensor<V>& b, OP3&& op) const
         {
+            detachModified<OP3>(a, b);
             strided_ptr().apply(a.strided_ptr(), b.strided_ptr(), op);
         }
         
-        template<class OP> void apply_parallel(OP&& op) const { strided_ptr().apply_parallel(op); }
+        template<class OP> void apply_parallel(OP&& op) const
+        {
+            if constexpr (!std::is_invocable_v<OP&, const T&>) detachShared();
+            strided_ptr().apply_parallel(op);
+        }
         
         template<class U, class OP2>
         void apply_parallel(const vtensor<U>& a, OP2&& op) const
         {
+            detachModified<OP2>(a);
             strided_ptr().apply_parallel(a.strided_ptr(), op);
         }
         
         template<class U, class V, class OP3>
         void apply_parallel(const vtensor<U>& a, const vtensor<V>& b, OP3&& op) const
         {
+            detachModified<OP3>(a, b);
             strided_ptr().apply_parallel(a.strided_ptr(), b.strided_ptr(), op);
         }
         
+        enum { KDefaultTileBytes = 32 << 20 };
+        
+        /** @brief calls tile_op(tile) for consecutive tiles of about tile_bytes size.
+         Tiles are cut along the axis with the largest stride, so every tile occupies a compact memory range.
+         For memory-mapped tensors the next tile is prefetched and pages of processed tiles are released,
+         so tensors larger than RAM can be processed with bounded resident memory.
+        */
+        template<class OP>
+        void for_each_tile(OP&& tile_op, size_t tile_bytes = KDefaultTileBytes) const
+        {
+            if (ndim()==0) { tile_op(*this); return; }
+            forEachTileRange(tile_bytes, [this, &tile_op](int axis, index_type b, index_type e, index_type next_e)
+                {
+                    if (e<next_e) cropAxis(axis, e, next_e).adviseMapped(KAdviseWillNeed);
+                    vtensor tile = cropAxis(axis, b, e);
+                    tile_op(tile);
+                    tile.adviseMapped(KAdviseRelease);
+                });
+        }
+        
+        /// apply() that walks memory-mapped tensor tile by tile (see for_each_tile)
+        template<class OP>
+        void apply_tiled(OP&& op, size_t tile_bytes = KDefaultTileBytes) const
+        {
+            for_each_tile( [&op](const vtensor& tile) { tile.apply(op); }, tile_bytes );
+        }
+        
+        /// apply() that walks memory-mapped tensors tile by tile, e.g. to convert one file into another
+        template<class U, class OP2>
+        void apply_tiled(const vtensor<U>& a, OP2&& op, size_t tile_bytes = KDefaultTileBytes) const
+        {
+            ASSERT(a.shape == shape);
+            if (ndim()==0) { apply(a, op); return; }
+            a.adviseMapped(KAdviseSequential);
+            forEachTileRange(tile_bytes, [this, &a, &op](int axis, index_type b, index_type e, index_type next_e)
+                {
+                    if (e<next_e)
+                    {
+                        cropAxis(axis, e, next_e).adviseMapped(KAdviseWillNeed);
+                        a.cropAxis(axis, e, next_e).adviseMapped(KAdviseWillNeed);
+                    }
+                    vtensor tile = cropAxis(axis, b, e);
+                    vtensor<U> tile_a = a.cropAxis(axis, b, e);
+                    tile.apply(tile_a, op);
+                    tile.adviseMapped(KAdviseRelease);
+                    tile_a.adviseMapped(KAdviseRelease);
+                });
+        }
+        
+    private:
+        /// gives a hint for the memory used by the tensor if the tensor is memory-mapped
+        void adviseMapped(mapped_memory_advice a) const
+        {
+#ifdef ALGOTEST_MEMORY_MAPPING_SUPPORTED
+            if (empty() || numElements()==0 || !std::dynamic_pointer_cast<MappedData>(dataHolder())) return;
+            index_type lo, hi;
+            shape.displaceRange(lo, hi);
+            MappedData::advise(data() + lo, size_t(hi-lo+1)*sizeof(T), a);
+#endif
+        }
+        
+        /// calls op(axis, begin, end, next_end) for ranges of the axis with the largest stride
+        template<class OP>
+        void forEachTileRange(size_t tile_bytes, OP&& op) const
+        {
+            ASSERT(ndim()>0);
+            int axis = 0;
+            for(int i=1; i<ndim(); ++i)
+            {
+                if (shape[i]>1 && std::abs(stride(i)) > std::abs(stride(axis))) axis = i;
+            }
+            
+            index_type n = shape[axis];
+            if (n==0) return;
+            size_t slice_bytes = size_t(numElements()/n)*sizeof(T);
+            index_type step = index_type( std::max<size_t>(1, tile_bytes/std::max<size_t>(1, slice_bytes)) );
+            
+            adviseMapped(KAdviseSequential);
+            for(index_type b=0; b<n; b+=step)
+            {
+                index_type e = std::min(n, b+step);
+                op(axis, b, e, std::min(n, e+step));
+            }
+        }
+        
+    public:
         friend std::ostream& operator<<(std::ostream& os, const vtensor& a)
         {
             a.strided_ptr().print(os);
@@ -353,6 +588,38 @@ namespace algotest
             apply_parallel(condition.upshape(shape), [val](T& v, const U& c) { if (c) v = val; } );
         }
 
+        /// elements where the condition (broadcast to the shape) holds, in row-major order, see compactOffsets
+        template<class U>
+        vtensor masked_select(const vtensor<U>& condition) const
+        {
+            const vtensor<U> mask = condition.upshape(shape);
+            auto select = [](const U& c) { return bool(c); };
+            std::vector<index_type> offsets = compactOffsets(mask, select);
+            vtensor res( tensor_shape{ offsets.back() } );
+            T * dst = res.data();
+            compactScatter(mask, select, offsets, [dst](index_type position, index_type, const T& v) { dst[position] = v; });
+            return res;
+        }
+
+        /// indices of non-zero elements, one row of ndim() coordinates per element in row-major order
+        vtensor<index_type> nonzero() const
+        {
+            auto select = [](const T& a) { return a!=T(0); };
+            std::vector<index_type> offsets = compactOffsets(*this, select);
+            int dims = ndim();
+            vtensor<index_type> res( tensor_shape{ offsets.back(), dims } );
+            index_type * dst = res.data();
+            compactScatter(*this, select, offsets, [&](index_type position, index_type flat, const T&)
+                {
+                    for(int i=dims-1; i>=0; --i)
+                    {
+                        dst[position*dims + i] = flat % shape[i];
+                        flat /= shape[i];
+                    }
+                });
+            return res;
+        }
+
         
         template<class U>
         void copyValuesFrom(const vtensor<U>& a)
@@ -360,17 +627,55 @@ namespace algotest
             apply(a.upshape(shape), [](T& r, const U& a) {r = a;});
         }
         
+        /// copy of a copy-on-write tensor shares data until one of the copies is modified
         vtensor<T> copy() const
+        {
+            if (m_cow && isSequential())
+            {
+                vtensor<T> res = *this;
+                res.m_cow = std::make_shared< CowData<T> >(m_cow->m_buffer);
+                res.m_data_holder = res.m_cow;
+                return res;
+            }
+            return deepCopy();
+        }
+        
+        /// copies values immediately even for copy-on-write tensor
+        vtensor<T> deepCopy() const
         {
             vtensor<T> res(shape);
             res.copyValuesFrom(*this);
             return res;
         }
         
+        /** @brief Switches the tensor into copy-on-write mode.
+         copy() of the tensor or its views (made after this call) shares the data.
+         The first modification (non-const apply, operator[], init, in-place operations)
+         makes a private copy of the data if it is still shared.
+         Values should be modified via the tensor itself, not via arguments of apply() of other tensors.
+        */
+        vtensor& enableCopyOnWrite()
+        {
+            if (m_cow || empty()) return *this;
+            
+            // find a memory span used by the tensor (strides may be negative)
+            index_type lo, hi;
+            shape.displaceRange(lo, hi);
+            index_type size = numElements()==0 ? 0 : hi-lo+1;
+            
+            auto buffer = std::make_shared< cow_buffer<T> >( cow_buffer<T>{ m_data_holder, m_data+lo, size } );
+            m_cow = std::make_shared< CowData<T> >( buffer );
+            m_cow_offset = -lo;
+            m_data_holder = m_cow;
+            return *this;
+        }
+        
+        bool isCopyOnWrite() const { return bool(m_cow); }
+        
         /// makes a sequential copy of tensor if the tensor is not sequential
         vtensor<T> sequential() const
         {
-            if (isSequential()) return *this; else return copy();
+            if (isSequential()) return *this; else return deepCopy();
         }
         
         vtensor<T> contiguous() const { return sequential(); }
@@ -469,19 +774,216 @@ namespace algotest
         template<class U=T>
         vtensor<U> sum(int axis) const
         {
-            makeAxisIndexPositive(axis);
-            if (axis == ndim()-1) return sum_last_axes<U>(1);
-            else return swapAxes(axis, ndim()-1).template sum_last_axes<U>(1).swapAxes(axis, ndim()-2);
+            return sum<U>( std::vector<int>{axis} );
         }
         
         template<class U=T>
         vtensor<U> mean(int axis) const
         {
-            makeAxisIndexPositive(axis);
-            vtensor<U> res = sum<U>(axis);
-            res/=U(shape[axis]);
+            return mean<U>( std::vector<int>{axis} );
+        }
+        
+        /** @brief reductions over a set of axes (all axes if axes is empty) in a single pass, see reduceAxes.
+         keepdims leaves reduced axes with size 1, the result is written into out if it is given
+         (out should have the shape of the result).
+        */
+        template<class U=T>
+        vtensor<U> sum(const std::vector<int>& axes, bool keepdims = false, vtensor<U> out = vtensor<U>()) const
+        {
+            return reduceAxes<U>(axes, keepdims, out,
+                                 [](vtensor<U>& r, const vtensor<T>&) { r.init(U(0)); },
+                                 [](U& r, const T& a) { r += a; },
+                                 [](U& r, const U& a) { r += a; });
+        }
+        
+        template<class U=T>
+        vtensor<U> prod(const std::vector<int>& axes, bool keepdims = false, vtensor<U> out = vtensor<U>()) const
+        {
+            return reduceAxes<U>(axes, keepdims, out,
+                                 [](vtensor<U>& r, const vtensor<T>&) { r.init(U(1)); },
+                                 [](U& r, const T& a) { r *= a; },
+                                 [](U& r, const U& a) { r *= a; });
+        }
+        
+        template<class U=T>
+        vtensor<U> mean(const std::vector<int>& axes, bool keepdims = false, vtensor<U> out = vtensor<U>()) const
+        {
+            vtensor<U> res = sum<U>(axes, keepdims, out);
+            res /= U( numElements()/std::max(1, res.numElements()) );
+            return res;
+        }
+        
+        /** @brief mean and variance over the axes in a single pass of Welford updates,
+         partial states of threads are merged by Chan's formula. Values are accumulated in
+         tensor_accumulator<U>::type (float for half). The variance is divided by count - ddof.
+        */
+        template<class U=T>
+        std::pair< vtensor<U>, vtensor<U> > moments(const std::vector<int>& axes, bool keepdims = false, int ddof = 0) const
+        {
+            typedef typename tensor_accumulator<U>::type A;
+            typedef welford_state<A> W;
+            
+            vtensor<W> states = reduceAxes<W>(axes, keepdims, vtensor<W>(),
+                                              [](vtensor<W>& r, const vtensor<T>&) { r.init(W()); },
+                                              [](W& w, const T& a) { w.add(A(a)); },
+                                              [](W& w, const W& o) { w.merge(o); });
+            
+            vtensor<U> mean( states.shape.copyShape() ), var( states.shape.copyShape() );
+            mean.apply_parallel(var, states, [ddof](U& m, U& v, const W& w)
+                {
+                    m = U(w.m_mean);
+                    v = U( w.m_m2/A(std::max<index_type>(1, w.m_n - ddof)) );
+                });
+            return { mean, var };
+        }
+        
+        template<class U=T>
+        vtensor<U> var(const std::vector<int>& axes, bool keepdims = false, int ddof = 0) const
+        {
+            return moments<U>(axes, keepdims, ddof).second;
+        }
+        
+        template<class U=T>
+        vtensor<U> std(const std::vector<int>& axes, bool keepdims = false, int ddof = 0) const
+        {
+            vtensor<U> res = var<U>(axes, keepdims, ddof);
+            res.apply_parallel( [](U& v) { v = U(sqrt(v)); } );
             return res;
         }
+
+        /** @brief vector p-norms over the axes in a single pass of reduceAxes: p=1 sums absolute values,
+         p=2 is euclidean, p=infinity is the maximal absolute value, p=0 counts non-zeros, other p are (sum |a|^p)^(1/p).
+         Values are accumulated in tensor_accumulator<U>::type.
+        */
+        template<class U=T>
+        vtensor<U> norm(const std::vector<int>& axes, double p = 2, bool keepdims = false) const
+        {
+            typedef typename tensor_accumulator<U>::type A;
+            auto reduce = [&](auto op, auto merge)
+            {
+                return reduceAxes<A>(axes, keepdims, vtensor<A>(), [](vtensor<A>& r, const vtensor<T>&) { r.init(A(0)); }, op, merge);
+            };
+            auto add = [](A& r, const A& a) { r += a; };
+            auto absolute = [](const T& a) { return A(a) < A(0) ? -A(a) : A(a); };
+
+            if (p==1) return reduce( [absolute](A& r, const T& a) { r += absolute(a); }, add ).template astype<U>();
+            if (p==0) return reduce( [](A& r, const T& a) { r += A( A(a)!=A(0) ); }, add ).template astype<U>();
+            if (p==std::numeric_limits<double>::infinity())
+            {
+                return reduce( [absolute](A& r, const T& a) { r = std::max(r, absolute(a)); },
+                               [](A& r, const A& a) { r = std::max(r, a); } ).template astype<U>();
+            }
+
+            auto root = [](const vtensor<A>& acc, auto f)
+            {
+                vtensor<U> res( acc.shape.copyShape() );
+                res.apply_parallel( acc, [&f](U& r, const A& a) { r = U( f(a) ); } );
+                return res;
+            };
+            if (p==2)
+            {
+                return root( reduce( [](A& r, const T& a) { r += A(a)*A(a); }, add ),
+                             [](const A& a) { return sqrt(a); } );
+            }
+            return root( reduce( [absolute, p](A& r, const T& a) { r += A( pow(double(absolute(a)), p) ); }, add ),
+                         [p](const A& a) { return pow(double(a), 1/p); } );
+        }
+
+        template<class U=T>
+        vtensor<U> norm(int axis, double p = 2) const
+        {
+            return norm<U>( std::vector<int>{axis}, p );
+        }
+
+        /** @brief true if pred holds for some element. Threads scan parts of the outermost axis in memory order
+         by blocks of lines and stop as soon as any of them finds an element.
+        */
+        template<class PRED>
+        bool any_of(PRED&& pred) const
+        {
+            if (numElements()==0) return false;
+            if (ndim()==0) return pred(*data());
+
+            int inner = 0, outer = 0;
+            for(int i=1; i<ndim(); ++i)
+            {
+                if (std::abs(stride(i)) < std::abs(stride(inner))) inner = i;
+                if (std::abs(stride(i)) > std::abs(stride(outer))) outer = i;
+            }
+            index_type s = stride(inner);
+            int num_parts = numElements() < KMinParallelReduction ? 1 : std::min<int>(sysutils::getOptimalParallelThreads(), shape[outer]);
+
+            std::atomic<bool> found(false);
+            sysutils::runForThreads(num_parts, 0, num_parts, [&](int beg, int end)
+                {
+                    for(int p=beg; p<end; ++p)
+                    {
+                        index_type b = index_type( int64_t(shape[outer])*p/num_parts ), e = index_type( int64_t(shape[outer])*(p+1)/num_parts );
+                        const vtensor part = cropAxis(outer, b, e);
+                        index_type n = part.shape[inner];
+                        part.destroyAxis(inner).apply( [&](const T& first)
+                            {
+                                for(index_type i=0; i<n && !found.load(std::memory_order_relaxed); i+=KSearchBlock)
+                                {
+                                    bool hit = false;
+                                    const T * line = &first + i*s;
+                                    for(index_type k=0, m=std::min<index_type>(KSearchBlock, n-i); k<m; ++k) hit |= bool( pred(line[k*s]) );
+                                    if (hit) found.store(true, std::memory_order_relaxed);
+                                }
+                            });
+                    }
+                });
+            return found.load();
+        }
+
+        template<class PRED>
+        bool all_of(PRED&& pred) const
+        {
+            return !any_of( [&pred](const T& a) { return !pred(a); } );
+        }
+
+        bool any() const { return any_of( [](const T& a) { return a!=T(0); } ); }
+        bool all() const { return !any_of( [](const T& a) { return a==T(0); } ); }
+
+        /** @brief logical or over the axes. A single axis is tested line by line in parallel,
+         every line stops at its first non-zero element.
+        */
+        vtensor<bool> any(const std::vector<int>& axes, bool keepdims = false) const
+        {
+            return testAxes(axes, keepdims, false);
+        }
+
+        /// logical and over the axes, see any
+        vtensor<bool> all(const std::vector<int>& axes, bool keepdims = false) const
+        {
+            return testAxes(axes, keepdims, true);
+        }
+
+        vtensor<index_type> count_nonzero(const std::vector<int>& axes, bool keepdims = false) const
+        {
+            return reduceAxes<index_type>(axes, keepdims, vtensor<index_type>(),
+                                          [](vtensor<index_type>& r, const vtensor<T>&) { r.init(0); },
+                                          [](index_type& r, const T& a) { r += a!=T(0); },
+                                          [](index_type& r, const index_type& a) { r += a; });
+        }
+
+        index_type count_nonzero() const { return count_nonzero( std::vector<int>() ).item(); }
+
+        vtensor max(const std::vector<int>& axes, bool keepdims = false, vtensor out = vtensor()) const
+        {
+            return reduceAxes<T>(axes, keepdims, out,
+                                 [](vtensor& r, const vtensor& first) { r.copyValuesFrom(first); },
+                                 [](T& r, const T& a) { if (r<a) r = a; },
+                                 [](T& r, const T& a) { if (r<a) r = a; });
+        }
+        
+        vtensor min(const std::vector<int>& axes, bool keepdims = false, vtensor out = vtensor()) const
+        {
+            return reduceAxes<T>(axes, keepdims, out,
+                                 [](vtensor& r, const vtensor& first) { r.copyValuesFrom(first); },
+                                 [](T& r, const T& a) { if (a<r) r = a; },
+                                 [](T& r, const T& a) { if (a<r) r = a; });
+        }
         
         template<class U=T>
         vtensor<U> sum_last_axes(int num_last_dims) const
@@ -496,7 +998,7 @@ namespace algotest
         /// find maximum value in a tensor
         const T& max() const
         {
-            const T * p_res = m_data;
+            const T * p_res = data();
             apply( [&p_res](const T& a) { if (*p_res<a) p_res=&a; } );
             return *p_res;
         }
@@ -504,51 +1006,551 @@ namespace algotest
         // find max along the given axis and destroys this axis
         vtensor max(int axis) const
         {
-            makeAxisIndexPositive(axis);
-            
-            vtensor res = destroyAxis(axis).copy().insertAxis(axis, shape[axis]);
-            apply( res, [](const T& a, T& m) { m = std::max(m,a); } );
-            return res.destroyAxis(axis);
+            return max( std::vector<int>{axis} );
         }
         
         const T& min() const
         {
-            const T * p_res = m_data;
+            const T * p_res = data();
             apply( [&p_res](const T& a) { if (*p_res>a) p_res=&a; } );
             return *p_res;
         }
         
         // find min along the given axis and destroys this axis
         vtensor min(int axis) const
+        {
+            return min( std::vector<int>{axis} );
+        }
+        
+        /// indices of maximal values along the axis, the first index wins on ties
+        vtensor<index_type> argmax(int axis) const { return max_with_index(axis).second; }
+        
+        /// indices of minimal values along the axis, the first index wins on ties
+        vtensor<index_type> argmin(int axis) const { return min_with_index(axis).second; }
+        
+        /// maximal values along the axis and their indices (the axis is destroyed) computed in one pass
+        std::pair< vtensor, vtensor<index_type> > max_with_index(int axis) const
+        {
+            return reduceWithIndex(axis, [](const T& a, const T& b) { return b<a; });
+        }
+        
+        std::pair< vtensor, vtensor<index_type> > min_with_index(int axis) const
+        {
+            return reduceWithIndex(axis, [](const T& a, const T& b) { return a<b; });
+        }
+        
+    private:
+        /** @brief sweeps slices along the axis in order: op(r, q, a, k) is called for k = 0..n-1 with
+         elements a of the slice k of this tensor and r, q of the slices k of results with the shape of this tensor
+         (a result without the axis is repeated along it by insertAxis). Every thread takes a block of the outermost
+         kept axis once and runs the whole recurrence over k in it, so the input is read in memory order and
+         slices update compact parts of results. Returns false (and does nothing) if the axis has the smallest stride,
+         then lines along the axis are compact and should be scanned one by one instead.
+        */
+        template<class U, class V, class OP>
+        bool sweepAxis(int axis, const vtensor<U>& r, const vtensor<V>& q, OP&& op) const
+        {
+            ASSERT(r.shape.copyShape() == shape.copyShape() && q.shape.copyShape() == shape.copyShape());
+            bool line_scan = true;
+            for(int i=0; i<ndim(); ++i)
+            {
+                if (i!=axis && shape[i]>1 && std::abs(stride(i)) < std::abs(stride(axis))) line_scan = false;
+            }
+            if (line_scan) return false;
+            
+            // the axis leads the walk, other axes follow in memory order, the first of them is split between threads
+            std::vector<int> order;
+            for(int i=0; i<ndim(); ++i) if (i!=axis) order.push_back(i);
+            std::stable_sort(order.begin(), order.end(),
+                             [this](int a, int b) { return std::abs(stride(a)) > std::abs(stride(b)); });
+            int split = *std::find_if(order.begin(), order.end(), [this](int a) { return shape[a]>1; });
+            order.insert(order.begin(), axis);
+            
+            index_type n = shape[axis];
+            int num_threads = numElements() < KMinParallelReduction ? 1 : sysutils::getOptimalParallelThreads();
+            num_threads = std::max(1, std::min<int>({ num_threads, shape[split], numElements()/n/KMinSweepLines }));
+            
+            r.detachShared();
+            q.detachShared();
+            sysutils::runForThreads(num_threads, 0, num_threads, [&](int beg, int end)
+                {
+                    for(int p=beg; p<end; ++p)
+                    {
+                        index_type b = index_type( int64_t(shape[split])*p/num_threads );
+                        index_type e = index_type( int64_t(shape[split])*(p+1)/num_threads );
+                        const vtensor src = cropAxis(split, b, e).permute(order);
+                        const vtensor<U> rs = r.cropAxis(split, b, e).permute(order);
+                        const vtensor<V> qs = q.cropAxis(split, b, e).permute(order);
+                        strided_array_ptr<T> ps = src.strided_ptr();
+                        strided_array_ptr<U> pr = rs.strided_ptr();
+                        strided_array_ptr<V> pq = qs.strided_ptr();
+                        
+                        // slices are views of the same pointers, so nothing is allocated per slice
+                        for(index_type k=0; k<n; ++k)
+                        {
+                            pr.subarray(pr.m_ptr + k*pr.m_strides[0]).apply(
+                                pq.subarray(pq.m_ptr + k*pq.m_strides[0]), ps.subarray(ps.m_ptr + k*ps.m_strides[0]),
+                                [&op, k](U& rv, V& qv, const T& a) { op(rv, qv, a, k); } );
+                        }
+                    }
+                });
+            return true;
+        }
+        
+        /** @brief values and indices of the best elements along the axis, better(a, b) is true if a replaces b.
+         When the axis has the smallest stride every line is scanned by one thread:
+         for a contiguous line the best value is found first (a loop without branches that vectorizes)
+         and then its first position. Otherwise slices along the axis are swept by sweepAxis updating
+         all results of a block at once, so the update vectorizes over the result.
+        */
+        template<class BETTER>
+        std::pair< vtensor, vtensor<index_type> > reduceWithIndex(int axis, BETTER&& better) const
         {
             makeAxisIndexPositive(axis);
+            index_type n = shape[axis];
+            ASSERT(n>0);
+            
+            vtensor values = destroyAxis(axis).deepCopy();
+            vtensor<index_type> indices( values.shape.copyShape(), initializer<index_type>(0) );
             
-            vtensor res = destroyAxis(axis).copy().insertAxis(axis, shape[axis]);
-            apply( res, [](const T& a, T& m) { m = std::min(m,a); } );
-            return res.destroyAxis(axis);
+            bool swept = sweepAxis(axis, values.insertAxis(axis, n), indices.insertAxis(axis, n),
+                                   [&better](T& v, index_type& index, const T& a, index_type k)
+                                   {
+                                       if (better(a, v)) { v = a; index = k; }
+                                   });
+            if (!swept)
+            {
+                index_type s = stride(axis);
+                const vtensor lines = destroyAxis(axis);
+                values.apply_parallel(indices, lines, [n, s, &better](T& v, index_type& index, const T& first)
+                    {
+                        const T * p = &first;
+                        if (s==1)
+                        {
+                            T best = p[0];
+                            for(index_type k=1; k<n; ++k) best = better(p[k], best) ? p[k] : best;
+                            index_type k = 0;
+                            while(k<n && !(p[k]==best)) ++k;
+                            v = best;
+                            index = k<n ? k : 0;
+                        }
+                        else
+                        {
+                            for(index_type k=1; k<n; ++k) if (better(p[k*s], v)) { v = p[k*s]; index = k; }
+                        }
+                    });
+            }
+            return { values, indices };
         }
         
+    public:
+        /// cumulative sum along the axis
+        template<class U=T>
+        vtensor<U> cumsum(int axis) const { return scan<U>(axis, [](const U& a, const U& b) { return a+b; }); }
+        
+        /// cumulative product along the axis
+        template<class U=T>
+        vtensor<U> cumprod(int axis) const { return scan<U>(axis, [](const U& a, const U& b) { return a*b; }); }
+        
+        /// running maximum along the axis
+        vtensor cummax(int axis) const { return scan<T>(axis, [](const T& a, const T& b) { return a<b ? b : a; }); }
+        
+        /// running minimum along the axis
+        vtensor cummin(int axis) const { return scan<T>(axis, [](const T& a, const T& b) { return b<a ? b : a; }); }
+        
+    private:
+        enum { KMinScanBlock = 1<<14 };
+        
+        /** @brief inclusive scan along the axis with an associative op(accumulated, value).
+         When the axis has the smallest stride lines are scanned independently by threads,
+         and if there are fewer lines than threads every long line is scanned by blocks in parallel:
+         blocks are scanned locally, block totals are scanned, then every block is combined with its carry.
+         For other axes slices are swept by sweepAxis: slice k = op(slice k-1, input slice k),
+         which vectorizes over contiguous inner axes and is parallel over blocks of kept positions.
+        */
+        template<class U, class OP>
+        vtensor<U> scan(int axis, OP&& op) const
+        {
+            makeAxisIndexPositive(axis);
+            index_type n = shape[axis];
+            vtensor<U> res(shape);
+            if (n==0) return res;
+            
+            // running values of lines are carried in a compact temporary
+            vtensor<U> carry( destroyAxis(axis).shape.copyShape() );
+            bool swept = sweepAxis(axis, res, carry.insertAxis(axis, n), [&op](U& r, U& c, const T& a, index_type k)
+                {
+                    c = k==0 ? U(a) : op(c, U(a));
+                    r = c;
+                });
+            if (swept) return res;
+            
+            index_type ss = stride(axis), ds = res.stride(axis);
+            int num_threads = sysutils::getOptimalParallelThreads();
+            int num_lines = numElements()/n;
+            const vtensor lines = destroyAxis(axis);
+            
+            if (num_lines >= num_threads || n < 2*KMinScanBlock)
+            {
+                res.destroyAxis(axis).apply_parallel( lines, [&op, n, ss, ds](U& out, const T& first)
+                    {
+                        scanLine(&first, ss, &out, ds, 0, n, op);
+                    });
+                return res;
+            }
+            
+            int num_parts = int( std::min<index_type>(num_threads, n/KMinScanBlock) );
+            std::vector<U> totals(num_parts);
+            res.destroyAxis(axis).apply( lines, [&](U& out, const T& first)
+                {
+                    U * dst = &out;
+                    auto block = [n, num_parts](int p) { return index_type( int64_t(n)*p/num_parts ); };
+                    sysutils::runForThreads(num_parts, 0, num_parts, [&](int beg, int end)
+                        {
+                            for(int p=beg; p<end; ++p)
+                            {
+                                scanLine(&first, ss, dst, ds, block(p), block(p+1), op);
+                                totals[p] = dst[(block(p+1)-1)*ds];
+                            }
+                        });
+                    for(int p=1; p<num_parts; ++p) totals[p] = op(totals[p-1], totals[p]);
+                    sysutils::runForThreads(num_parts-1, 1, num_parts, [&](int beg, int end)
+                        {
+                            for(int p=beg; p<end; ++p)
+                            {
+                                U carry = totals[p-1];
+                                for(index_type k=block(p); k<block(p+1); ++k) dst[k*ds] = op(carry, dst[k*ds]);
+                            }
+                        });
+                });
+            return res;
+        }
+        
+        /// scan of positions [b, e) of one line, starting from the value at b
+        template<class U, class OP>
+        static void scanLine(const T * src, index_type ss, U * dst, index_type ds, index_type b, index_type e, OP& op)
+        {
+            U acc = U(src[b*ss]);
+            dst[b*ds] = acc;
+            for(index_type k=b+1; k<e; ++k)
+            {
+                acc = op(acc, U(src[k*ss]));
+                dst[k*ds] = acc;
+            }
+        }
+        
+    public:
         // find softmax along the given axis
+        // temporaries are bounded by tensor_memory_budget, large tensors are processed in chunks
         template<class U=T>
-        vtensor softmax(int axis) const
+        vtensor<U> softmax(int axis) const
+        {
+            vtensor<U> res(shape);
+            normalizeTo(res, axis, false);
+            return res;
+        }
+        
+        template<class U=T>
+        vtensor<U> log_softmax(int axis) const
+        {
+            vtensor<U> res(shape);
+            normalizeTo(res, axis, true);
+            return res;
+        }
+        
+        void softmax_inplace(int axis) { prepareWrite(); normalizeTo(*this, axis, false); }
+        void log_softmax_inplace(int axis) { prepareWrite(); normalizeTo(*this, axis, true); }
+        
+        /// log(sum(exp(x))) along the axis (the axis is destroyed) computed in one pass without overflow
+        template<class U=T>
+        vtensor<U> logsumexp(int axis) const
         {
             makeAxisIndexPositive(axis);
+            vtensor<U> res( destroyAxis(axis).shape.copyShape() );
+            logSumExpTo(res, axis);
+            return res;
+        }
+        
+    private:
+        enum { KSoftmaxBlock = 256 };
+        
+        /// softmax (exp(x - lse)) or log_softmax (x - lse) into res, res may be this tensor
+        template<class U>
+        void normalizeTo(vtensor<U>& res, int axis, bool log) const
+        {
+            makeAxisIndexPositive(axis);
+            index_type n = shape[axis];
+            // logsumexp and the online accumulators for every line along the axis
+            size_t temp_bytes = size_t(numElements()/std::max(1, n))*3*sizeof(U);
             
-            vtensor maxValues = max(axis);
-            vtensor<U> expSum(maxValues.shape, initializer<U>(0.0));
+            forEachBudgetChunk(axis, temp_bytes, [this, &res, axis, n, log](int chunk_axis, index_type b, index_type e)
+                {
+                    const vtensor src = chunk_axis<0 ? *this : cropAxis(chunk_axis, b, e);
+                    vtensor<U> dst = chunk_axis<0 ? res : res.cropAxis(chunk_axis, b, e);
+                    vtensor<U> lse( src.destroyAxis(axis).shape.copyShape() );
+                    src.logSumExpTo(lse, axis);
+                    
+                    const vtensor<U> lse_repl = lse.insertAxis(axis, n);
+                    if (log) dst.apply_parallel(src, lse_repl, [](U& r, const T& a, const U& l) { r = U(a) - l; });
+                    else dst.apply_parallel(src, lse_repl, [](U& r, const T& a, const U& l) { r = exp(U(a) - l); });
+                });
+        }
+        
+        /** @brief logsumexp along the axis by the online max-rescaling: the running maximum m and the sum
+         s of exp(x - m) are updated together (s is rescaled by exp(m_old - m_new) when the maximum grows),
+         so the input is read once. A line with the smallest stride is processed by one thread,
+         contiguous lines by blocks: the block maximum and the block sum of exponents are branch-free loops
+         that vectorize, then the block is merged into (m, s). For other axes slices along the axis
+         are swept by sweepAxis updating all lines of a block at once.
+        */
+        template<class U>
+        void logSumExpTo(vtensor<U>& lse, int axis) const
+        {
+            index_type n = shape[axis];
+            ASSERT(n>0);
+            
+            auto merge = [](U& m, U& s, const U& bm, const U& bs)
+            {
+                if (bm>m) { s = s*exp(m-bm) + bs; m = bm; }
+                else s += bs*exp(bm-m);
+            };
+            
+            // the running maximum is kept in lse, sums of exponents in a temporary
+            vtensor<U> sums( lse.shape.copyShape() );
+            bool swept = sweepAxis(axis, lse.insertAxis(axis, n), sums.insertAxis(axis, n),
+                                   [&merge](U& m, U& s, const T& a, index_type k)
+                                   {
+                                       if (k==0) { m = U(a); s = 1; }
+                                       else merge(m, s, U(a), U(1));
+                                   });
+            if (swept)
+            {
+                lse.apply_parallel(sums, [](U& l, const U& s) { l += log(s); });
+            }
+            else
+            {
+                index_type st = stride(axis);
+                const vtensor lines = destroyAxis(axis);
+                lse.apply_parallel(lines, [n, st, &merge](U& l, const T& first)
+                    {
+                        const T * p = &first;
+                        U m = U(p[0]), s = 0;
+                        if (st==1)
+                        {
+                            for(index_type b=0; b<n; b+=KSoftmaxBlock)
+                            {
+                                index_type e = std::min<index_type>(n, b+KSoftmaxBlock);
+                                U bm = U(p[b]), bs = 0;
+                                for(index_type k=b+1; k<e; ++k) bm = U(p[k])>bm ? U(p[k]) : bm;
+                                for(index_type k=b; k<e; ++k) bs += exp(U(p[k]) - bm);
+                                merge(m, s, bm, bs);
+                            }
+                        }
+                        else
+                        {
+                            for(index_type k=0; k<n; ++k) merge(m, s, U(p[k*st]), U(1));
+                        }
+                        l = m + log(s);
+                    });
+            }
+        }
+        
+        /** @brief calls op(chunk_axis, begin, end) for chunks of the tensor along an axis other than skip_axis,
+         so temporaries of temp_bytes for the whole tensor take at most tensor_memory_budget for one chunk.
+         op(-1, 0, 0) is called once if the tensor fits into the budget or cannot be split.
+        */
+        template<class OP>
+        void forEachBudgetChunk(int skip_axis, size_t temp_bytes, OP&& op) const
+        {
+            size_t budget = tensor_memory_budget::get();
+            
+            // the longest independent axis gives the finest chunks
+            int axis = -1;
+            for(int i=0; i<ndim(); ++i)
+            {
+                if (i!=skip_axis && shape[i]>1 && (axis<0 || shape[i]>shape[axis])) axis = i;
+            }
+            
+            if (budget==0 || temp_bytes<=budget || axis<0) { op(-1, 0, 0); return; }
             
-            apply(    expSum.insertAxis(axis, shape[axis]),
-                   maxValues.insertAxis(axis, shape[axis]),
-                   [](const T& a, U& exps, T& maxv) { exps += exp(U(a-maxv)); } );
+            index_type n = shape[axis];
+            size_t slice_bytes = std::max<size_t>(1, temp_bytes/size_t(n));
+            index_type step = index_type( std::max<size_t>(1, budget/slice_bytes) );
             
-            vtensor res = astype<U>();
+            for(index_type b=0; b<n; b+=step)
+            {
+                op(axis, b, std::min(n, b+step));
+            }
+        }
+        
+        /** @brief reduces axes of this tensor into a result of type U in a single pass.
+         init(res, first) initializes the result (first is the slice at index 0 of the reduced axes),
+         op(r, a) accumulates a value, merge(r, p) combines partial results of threads.
+         Axes are walked in the order of decreasing strides of this tensor, so the input is read sequentially.
+         Threads split a kept axis when the result is large enough, otherwise every thread reduces
+         a part of the outermost reduced axis into its own partial result and partials are merged.
+        */
+        template<class U, class INIT, class OP, class MERGE>
+        vtensor<U> reduceAxes(std::vector<int> axes, bool keepdims, const vtensor<U>& out,
+                              INIT&& init, OP&& op, MERGE&& merge) const
+        {
+            ASSERT(ndim()>0);
+            if (axes.empty()) for(int i=0; i<ndim(); ++i) axes.push_back(i);
+            for(int& axis : axes) makeAxisIndexPositive(axis);
+            std::sort(axes.begin(), axes.end());
+            axes.erase(std::unique(axes.begin(), axes.end()), axes.end());
             
-            res.apply( expSum.insertAxis(axis, shape[axis]),
-                    maxValues.insertAxis(axis, shape[axis]),
-                   [](U& res, const U& exps, const T& maxv) { res = exp(U(res-maxv))/exps; } );
+            std::vector<bool> reduced(ndim(), false);
+            for(int axis : axes) reduced[axis] = true;
             
+            tensor_shape res_shape;
+            tensor<T> first(*this);
+            for(int i=ndim()-1; i>=0; --i)
+            {
+                if (!reduced[i]) res_shape.insertAxis(0, shape[i]);
+                else
+                {
+                    if (keepdims) res_shape.insertAxis(0, 1);
+                    first = first.destroyAxis(i);
+                }
+            }
+            
+            tensor<U> res = out.empty() ? tensor<U>(res_shape) : tensor<U>(out);
+            ASSERT(res.shape.copyShape() == res_shape);
+            
+            // kept is the result without reduced axes, acc repeats it along reduced axes (0-stride)
+            tensor<U> kept = res;
+            if (keepdims) for(int i=ndim()-1; i>=0; --i) if (reduced[i]) kept = kept.destroyAxis(i);
+            tensor<U> acc = kept;
+            for(int axis : axes) acc = acc.insertAxis(axis, shape[axis]);
+            init(kept, first);
+            
+            // memory order of this tensor
+            std::vector<int> order(ndim());
+            for(int i=0; i<ndim(); ++i) order[i] = i;
+            std::stable_sort(order.begin(), order.end(),
+                             [this](int a, int b) { return std::abs(stride(a)) > std::abs(stride(b)); });
+            
+            // this tensor leads the walk, the accumulator may not (its strides are 0 along reduced axes)
+            auto step = [&op](const T& a, U& r) { op(r, a); };
+            int num_threads = sysutils::getOptimalParallelThreads();
+            if (num_threads<=1 || numElements() < KMinParallelReduction)
+            {
+                const vtensor src = permute(order);
+                src.apply( acc.permute(order), step );
+                return res;
+            }
+            
+            if (kept.numElements() >= num_threads)
+            {
+                // the outermost kept axis is split between threads, they write different results
+                auto outer = std::find_if(order.begin(), order.end(), [&reduced](int a) { return !reduced[a]; });
+                std::rotate(order.begin(), outer, outer+1);
+                const vtensor src = permute(order);
+                src.apply_parallel( acc.permute(order), step );
+                return res;
+            }
+            
+            int split = order[0];
+            num_threads = std::min<int>(num_threads, shape[split]);
+            std::vector< tensor<U> > partials;
+            for(int t=0; t<num_threads; ++t) partials.emplace_back( kept.shape.copyShape() );
+            sysutils::runForThreads(num_threads, 0, num_threads, [&](int beg, int end)
+                {
+                    for(int t=beg; t<end; ++t)
+                    {
+                        index_type b = index_type(shape[split])*t/num_threads, e = index_type(shape[split])*(t+1)/num_threads;
+                        init(partials[t], first);
+                        tensor<U> part_acc = partials[t];
+                        for(int axis : axes) part_acc = part_acc.insertAxis(axis, shape[axis]);
+                        const vtensor src = cropAxis(split, b, e).permute(order);
+                        src.apply( part_acc.cropAxis(split, b, e).permute(order), step );
+                    }
+                });
+            for(const tensor<U>& p : partials) kept.apply(p, merge);
+            return res;
+        }
+        
+        vtensor<bool> testAxes(std::vector<int> axes, bool keepdims, bool all) const
+        {
+            if (axes.size()!=1 || ndim()==0)
+            {
+                return reduceAxes<bool>(axes, keepdims, vtensor<bool>(),
+                                        [all](vtensor<bool>& r, const vtensor<T>&) { r.init(all); },
+                                        [all](bool& r, const T& a) { if (r!=all) return; r = a!=T(0); },
+                                        [all](bool& r, const bool& a) { r = all ? r && a : r || a; });
+            }
+
+            int axis = axes[0];
+            makeAxisIndexPositive(axis);
+            tensor_shape res_shape = keepdims ? shape.copyShape() : destroyAxis(axis).shape.copyShape();
+            if (keepdims) res_shape[axis] = 1;
+
+            vtensor<bool> res(res_shape);
+            vtensor<bool> lines_res = keepdims ? res.destroyAxis(axis) : res;
+            index_type n = shape[axis], s = stride(axis);
+            lines_res.apply_parallel( destroyAxis(axis), [n, s, all](bool& r, const T& first)
+                {
+                    // index of the first element that decides the line
+                    const T * line = &first;
+                    index_type i = 0;
+                    if (all) while(i<n && line[i*s]!=T(0)) ++i;
+                    else     while(i<n && line[i*s]==T(0)) ++i;
+                    r = all ? i==n : i<n;
+                });
             return res;
         }
+
+        /** @brief first phase of stream compaction of selected elements in row-major order:
+         parts of axis 0 count their selected elements in parallel, offsets of parts are prefix sums of counts
+         (the last one is the total).
+        */
+        template<class M, class SELECT>
+        std::vector<index_type> compactOffsets(const vtensor<M>& mask, SELECT&& select) const
+        {
+            ASSERT(ndim()>0);
+            index_type rows = shape[0];
+            int num_parts = numElements() < KMinParallelReduction ? 1 : std::min<int>(sysutils::getOptimalParallelThreads(), rows);
+            num_parts = std::max(1, num_parts);
+
+            std::vector<index_type> offsets( size_t(num_parts)+1, 0 );
+            sysutils::runForThreads(num_parts, 0, num_parts, [&](int beg, int end)
+                {
+                    for(int p=beg; p<end; ++p)
+                    {
+                        index_type b = index_type( int64_t(rows)*p/num_parts ), e = index_type( int64_t(rows)*(p+1)/num_parts );
+                        index_type count = 0;
+                        cropAxis(0, b, e).apply( mask.cropAxis(0, b, e), [&](const T&, const M& m) { count += bool( select(m) ); } );
+                        offsets[p+1] = count;
+                    }
+                });
+            for(int p=0; p+1<int(offsets.size()); ++p) offsets[p+1] += offsets[p];
+            return offsets;
+        }
+
+        /// second phase of stream compaction: every part calls emit(position, flat index, value) from its offset
+        template<class M, class SELECT, class EMIT>
+        void compactScatter(const vtensor<M>& mask, SELECT&& select, const std::vector<index_type>& offsets, EMIT&& emit) const
+        {
+            index_type rows = shape[0], row_size = rows>0 ? numElements()/rows : 0;
+            int num_parts = int(offsets.size())-1;
+            sysutils::runForThreads(num_parts, 0, num_parts, [&](int beg, int end)
+                {
+                    for(int p=beg; p<end; ++p)
+                    {
+                        index_type b = index_type( int64_t(rows)*p/num_parts ), e = index_type( int64_t(rows)*(p+1)/num_parts );
+                        index_type position = offsets[p], flat = b*row_size;
+                        cropAxis(0, b, e).apply( mask.cropAxis(0, b, e), [&](const T& v, const M& m)
+                            {
+                                if (select(m)) emit(position++, flat, v);
+                                ++flat;
+                            });
+                    }
+                });
+        }
+
+    public:
+        enum { KMinParallelReduction = 1<<15, KSearchBlock = 1024, KMinSweepLines = 16 };
         
         template<class U=T>
         vtensor<U> partial_product_sum(const vtensor<T>& other, int num_last_dims) const
@@ -564,17 +1566,65 @@ namespace algotest
             return res;
         }
         
+        /** @brief matrix product, works for views with any strides (see tensor_gemm).
+         Tensors of rank > 2 are batches of matrices in the last two axes.
+         Batch axes are broadcast as in numpy: they are aligned to the right,
+         missing axes and axes of size 1 (or 0-stride insertAxis views) are repeated.
+        */
         template<class U=T>
         vtensor<U> matmul(const vtensor<T>& other) const
         {
-            ASSERT(ndim()==2 && other.ndim()==2);
-            return insertAxis(1, other.shape[1]).template partial_product_sum<U>(
-                       other.transpose().insertAxis(0, shape[0]), 1);
+            ASSERT(ndim()>=2 && other.ndim()>=2);
+            index_type m = shape[ndim()-2], k = shape[ndim()-1], n = other.shape[other.ndim()-1];
+            ASSERT(other.shape[other.ndim()-2]==k);
+            
+            int nb = std::max(ndim(), other.ndim()) - 2;
+            int da = nb - (ndim()-2), db = nb - (other.ndim()-2);
+            tensor_index batch_shape(nb, 1), a_strides(nb, 0), b_strides(nb, 0);
+            for(int i=0; i<nb; ++i)
+            {
+                index_type sa = i>=da ? shape[i-da] : 1;
+                index_type sb = i>=db ? other.shape[i-db] : 1;
+                ASSERT(sa==sb || sa==1 || sb==1); // batch axes can't be broadcast
+                batch_shape[i] = std::max(sa, sb);
+                if (sa>1) a_strides[i] = stride(i-da);
+                if (sb>1) b_strides[i] = other.stride(i-db);
+            }
+            
+            vtensor<U> res( tensor_shape( tensor_shape(batch_shape), tensor_shape{ m, n } ) );
+            
+            // displacements of every product, the batch is walked in row-major order
+            std::vector<tensor_gemm::batch_item> items( size_t( tensor_shape(batch_shape).numElements() ) );
+            for(size_t t=0; t<items.size(); ++t)
+            {
+                index_type rest = index_type(t), a_disp = 0, b_disp = 0;
+                for(int i=nb-1; i>=0; --i)
+                {
+                    index_type idx = rest % batch_shape[i];
+                    rest /= batch_shape[i];
+                    a_disp += idx*a_strides[i];
+                    b_disp += idx*b_strides[i];
+                }
+                items[t] = tensor_gemm::batch_item{ a_disp, b_disp, index_type(t)*m*n };
+            }
+            
+            tensor_gemm::multiplyBatched( items, m, n, k, matrixRef(), other.matrixRef(), std::as_const(res).matrixRef() );
+            return res;
         }
         
+        /// strided view of the last two axes for tensor_gemm
+        tensor_gemm::matrix_ref<T> matrixRef() const
+        {
+            ASSERT(ndim()>=2);
+            return tensor_gemm::matrix_ref<T>{ data(), stride(ndim()-2), stride(ndim()-1) };
+        }
+        
+        /// writable view of the last two axes, copy-on-write tensor gets private data
+        tensor_gemm::matrix_ref<T> matrixRef() { prepareWrite(); return std::as_const(*this).matrixRef(); }
+        
         vtensor window(int axis, int step, int size) const
         {
-            return vtensor( shape.copy().window(axis, step, size), m_data, m_data_holder);
+            return makeView(shape.copy().window(axis, step, size));
         }
         
         vtensor pad(const std::vector<int>& axes, int pad_before, int pad_after, const T& value = T(0))
@@ -796,6 +1846,23 @@ namespace algotest
             return vtensor(s, initializer(T(1)));
         }
 
+        static vtensor identity(index_type n)
+        {
+            vtensor res({n, n}, initializer(T(0)));
+            for(index_type i=0; i<n; ++i) res[{i,i}] = T(1);
+            return res;
+        }
+
+        /// uniformly distributed values in [from, to), the sequence is repeated from run to run
+        static vtensor random(const tensor_shape& s, const T& from, const T& to)
+        {
+            static std::mt19937 g_engine;
+            std::uniform_real_distribution<double> uniform{ double(from), double(to) };
+            vtensor res(s);
+            res.apply( [&uniform](T& t) { t = T( uniform(g_engine) ); } );
+            return res;
+        }
+
         vtensor meshgrid(const vtensor& other)
         {
             ASSERT(ndim()==1 && other.ndim()==1);
@@ -915,7 +1982,7 @@ namespace algotest
     // tensor represents tensor with "reference" semantics (i.e. like python variables)
     // were assignment operator copies references, not values
     template<class T>
-    class [[nodiscard]] tensor : public vtensor<T>
+    class [[nodiscard]] tensor<T> : public vtensor<T>
     {
         typedef vtensor<T> Base;
     public:
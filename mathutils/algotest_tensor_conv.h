@@ -0,0 +1,240 @@
+/*  The Mathutil library
+ Copyright (C) 2007-2022 Maksym Davydov
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; version 3
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef algotest_tensor_conv_included
+#define algotest_tensor_conv_included
+
+#include <vector>
+#include "algotest_tensor.h"
+
+namespace algotest
+{
+    enum conv_layout { KLayoutNCHW, KLayoutNHWC };
+    enum conv_algorithm { KConvAuto, KConvDirect, KConvIm2col };
+
+    struct conv2d_params
+    {
+        conv_layout m_layout = KLayoutNCHW;
+        int m_stride_h = 1, m_stride_w = 1;
+        int m_dilation_h = 1, m_dilation_w = 1;
+        int m_pad_h = 0, m_pad_w = 0;       // zero padding on both sides
+        int m_groups = 1;
+        conv_algorithm m_algorithm = KConvAuto;
+    };
+
+    /**
+     @brief tensor_conv implements 2D convolution (cross-correlation) on strided tensors.
+     The direct kernel accumulates whole output rows and is used for few input channels per group,
+     otherwise patches are unfolded into a matrix (im2col) and multiplied by tensor_gemm.
+     Both work with any strides, so NCHW and NHWC differ only in the strides of the same axes.
+     */
+    class tensor_conv : public tensor_settings
+    {
+    public:
+        enum { KDirectMaxChannels = 4 };
+
+        /// strides and sizes of a 4D image tensor in N,C,H,W order independent of the layout
+        struct image_ref
+        {
+            index_type m_n, m_c, m_h, m_w;
+            index_type m_sn, m_sc, m_sh, m_sw;
+
+            template<class T>
+            image_ref(const vtensor<T>& t, conv_layout layout)
+            {
+                ASSERT(t.ndim()==4);
+                int c_axis = layout==KLayoutNCHW ? 1 : 3;
+                int h_axis = layout==KLayoutNCHW ? 2 : 1;
+                m_n = t.shape[0];      m_sn = t.stride(0);
+                m_c = t.shape[c_axis]; m_sc = t.stride(c_axis);
+                m_h = t.shape[h_axis]; m_sh = t.stride(h_axis);
+                m_w = t.shape[h_axis+1]; m_sw = t.stride(h_axis+1);
+            }
+        };
+
+        struct geometry
+        {
+            image_ref m_in, m_out;
+            index_type m_kh, m_kw, m_cg, m_og;  // kernel size, input and output channels per group
+            conv2d_params m_p;
+        };
+
+        /// range [lo, hi) of output positions o with 0 <= o*stride + offset < size
+        static void validRange(index_type size, index_type out_size, index_type stride, index_type offset,
+                               index_type& lo, index_type& hi)
+        {
+            lo = offset>=0 ? 0 : (-offset + stride - 1)/stride;
+            hi = size-1-offset < 0 ? 0 : std::min<index_type>(out_size, (size-1-offset)/stride + 1);
+            if (hi<lo) hi = lo;
+        }
+
+        /// accumulates output rows (n, o, oh) directly, w is contiguous O x Cg x KH x KW
+        template<class T>
+        static void direct(const geometry& g, const T * in, const T * w, T * out)
+        {
+            const conv2d_params& p = g.m_p;
+            index_type ow_size = g.m_out.m_w;
+            index_type num_rows = g.m_out.m_n*g.m_out.m_c*g.m_out.m_h;
+
+            sysutils::runForThreads(sysutils::KNumThreadsAuto, 0, num_rows, [&](int beg, int end)
+                {
+                    std::vector<T> acc( static_cast<size_t>(ow_size) );
+                    for(int row=beg; row<end; ++row)
+                    {
+                        index_type oh = row % g.m_out.m_h;
+                        index_type o = (row / g.m_out.m_h) % g.m_out.m_c;
+                        index_type n = row / (g.m_out.m_h*g.m_out.m_c);
+                        index_type group = o / g.m_og;
+                        std::fill(acc.begin(), acc.end(), T(0));
+
+                        for(index_type c=0; c<g.m_cg; ++c)
+                        {
+                            const T * in_c = in + n*g.m_in.m_sn + (group*g.m_cg + c)*g.m_in.m_sc;
+                            const T * w_c = w + (o*g.m_cg + c)*g.m_kh*g.m_kw;
+                            for(index_type kh=0; kh<g.m_kh; ++kh)
+                            {
+                                index_type ih = oh*p.m_stride_h - p.m_pad_h + kh*p.m_dilation_h;
+                                if (ih<0 || ih>=g.m_in.m_h) continue;
+                                const T * in_row = in_c + ih*g.m_in.m_sh;
+                                for(index_type kw=0; kw<g.m_kw; ++kw)
+                                {
+                                    T wv = w_c[kh*g.m_kw + kw];
+                                    index_type offset = kw*p.m_dilation_w - p.m_pad_w, lo, hi;
+                                    validRange(g.m_in.m_w, ow_size, p.m_stride_w, offset, lo, hi);
+
+                                    index_type step = p.m_stride_w*g.m_in.m_sw;
+                                    const T * src = in_row + offset*g.m_in.m_sw;
+                                    T * dst = acc.data();
+                                    if (step==1) for(index_type ow=lo; ow<hi; ++ow) dst[ow] += wv*src[ow];
+                                    else         for(index_type ow=lo; ow<hi; ++ow) dst[ow] += wv*src[ow*step];
+                                }
+                            }
+                        }
+
+                        T * out_row = out + n*g.m_out.m_sn + o*g.m_out.m_sc + oh*g.m_out.m_sh;
+                        for(index_type ow=0; ow<ow_size; ++ow) out_row[ow*g.m_out.m_sw] = acc[ow];
+                    }
+                });
+        }
+
+        /// unfolds patches of image n, group g into the K x P matrix cols, K = (c,kh,kw), P = (oh,ow)
+        template<class T>
+        static void im2col(const geometry& g, const T * in, index_type n, index_type group,
+                           const tensor_gemm::matrix_ref<T>& cols)
+        {
+            const conv2d_params& p = g.m_p;
+            for(index_type c=0; c<g.m_cg; ++c)
+            {
+                const T * in_c = in + n*g.m_in.m_sn + (group*g.m_cg + c)*g.m_in.m_sc;
+                for(index_type kh=0; kh<g.m_kh; ++kh)
+                {
+                    for(index_type kw=0; kw<g.m_kw; ++kw)
+                    {
+                        index_type k = (c*g.m_kh + kh)*g.m_kw + kw;
+                        index_type offset = kw*p.m_dilation_w - p.m_pad_w, lo, hi;
+                        validRange(g.m_in.m_w, g.m_out.m_w, p.m_stride_w, offset, lo, hi);
+                        for(index_type oh=0; oh<g.m_out.m_h; ++oh)
+                        {
+                            index_type ih = oh*p.m_stride_h - p.m_pad_h + kh*p.m_dilation_h;
+                            index_type pos = oh*g.m_out.m_w;
+                            if (ih<0 || ih>=g.m_in.m_h)
+                            {
+                                for(index_type ow=0; ow<g.m_out.m_w; ++ow) cols(k, pos+ow) = T(0);
+                                continue;
+                            }
+                            const T * src = in_c + ih*g.m_in.m_sh + offset*g.m_in.m_sw;
+                            for(index_type ow=0; ow<lo; ++ow) cols(k, pos+ow) = T(0);
+                            for(index_type ow=lo; ow<hi; ++ow) cols(k, pos+ow) = src[ow*p.m_stride_w*g.m_in.m_sw];
+                            for(index_type ow=hi; ow<g.m_out.m_w; ++ow) cols(k, pos+ow) = T(0);
+                        }
+                    }
+                }
+            }
+        }
+
+        /// out(Og x P) = W_g(Og x K) * cols(K x P) for every image and group
+        template<class T>
+        static void im2colGemm(const geometry& g, const T * in, const T * w, T * out)
+        {
+            index_type k = g.m_cg*g.m_kh*g.m_kw;
+            index_type num_pos = g.m_out.m_h*g.m_out.m_w;
+            index_type count = g.m_out.m_n*g.m_p.m_groups;
+            // few large products use threads inside tensor_gemm, many small ones are split between threads
+            bool parallel_items = count >= sysutils::getOptimalParallelThreads();
+
+            // keep the positions contiguous in cols when they are contiguous in the input (NCHW)
+            bool positions_inner = std::abs(g.m_in.m_sw) <= std::abs(g.m_in.m_sc);
+
+            sysutils::runForThreads(parallel_items ? int(sysutils::KNumThreadsAuto) : 1, 0, count, [&](int beg, int end)
+                {
+                    std::vector<T> buffer( size_t(k)*num_pos );
+                    tensor_gemm::matrix_ref<T> cols = positions_inner ?
+                        tensor_gemm::matrix_ref<T>{ buffer.data(), num_pos, 1 } :
+                        tensor_gemm::matrix_ref<T>{ buffer.data(), 1, k };
+
+                    for(int item=beg; item<end; ++item)
+                    {
+                        index_type n = item / g.m_p.m_groups, group = item % g.m_p.m_groups;
+                        im2col(g, in, n, group, cols);
+
+                        tensor_gemm::matrix_ref<const T> wg { w + group*g.m_og*k, k, 1 };
+                        // output positions (oh,ow) of a contiguous output have a single stride m_sw
+                        tensor_gemm::matrix_ref<T> og { out + n*g.m_out.m_sn + group*g.m_og*g.m_out.m_sc,
+                                                        g.m_out.m_sc, g.m_out.m_sw };
+                        tensor_gemm::multiply(g.m_og, num_pos, k, wg, cols, og, KGemmSet,
+                                              parallel_items ? 1 : int(sysutils::KNumThreadsAuto));
+                    }
+                });
+        }
+    };
+
+    /** @brief 2D convolution (cross-correlation as in deep learning frameworks).
+     input is N x C x H x W (KLayoutNCHW) or N x H x W x C (KLayoutNHWC), weight is O x C/groups x KH x KW.
+     The result has the layout of the input.
+    */
+    template<class T>
+    tensor<T> conv2d(const vtensor<T>& input, const vtensor<T>& weight, const conv2d_params& params = conv2d_params())
+    {
+        typedef tensor_settings::index_type index_type;
+        ASSERT(input.ndim()==4 && weight.ndim()==4);
+        ASSERT(params.m_stride_h>0 && params.m_stride_w>0 && params.m_dilation_h>0 && params.m_dilation_w>0);
+        ASSERT(params.m_pad_h>=0 && params.m_pad_w>=0 && params.m_groups>0);
+
+        tensor_conv::image_ref in(input, params.m_layout);
+        index_type out_c = weight.shape[0], kh = weight.shape[2], kw = weight.shape[3];
+        ASSERT(in.m_c % params.m_groups == 0 && out_c % params.m_groups == 0);
+        ASSERT(weight.shape[1] == in.m_c/params.m_groups);
+
+        index_type out_h = (in.m_h + 2*params.m_pad_h - params.m_dilation_h*(kh-1) - 1)/params.m_stride_h + 1;
+        index_type out_w = (in.m_w + 2*params.m_pad_w - params.m_dilation_w*(kw-1) - 1)/params.m_stride_w + 1;
+        ASSERT(out_h>0 && out_w>0);
+
+        tensor<T> res( params.m_layout==KLayoutNCHW ? tensor_shape{ in.m_n, out_c, out_h, out_w }
+                                                    : tensor_shape{ in.m_n, out_h, out_w, out_c } );
+        tensor_conv::geometry g { in, tensor_conv::image_ref(res, params.m_layout), kh, kw,
+                                  in.m_c/params.m_groups, out_c/params.m_groups, params };
+
+        vtensor<T> w = weight.contiguous();
+        conv_algorithm algorithm = params.m_algorithm;
+        if (algorithm==KConvAuto) algorithm = g.m_cg <= tensor_conv::KDirectMaxChannels ? KConvDirect : KConvIm2col;
+
+        if (algorithm==KConvDirect) tensor_conv::direct(g, std::as_const(input).data(), std::as_const(w).data(), res.data());
+        else tensor_conv::im2colGemm(g, std::as_const(input).data(), std::as_const(w).data(), res.data());
+        return res;
+    }
+}
+
+#endif // algotest_tensor_conv_included
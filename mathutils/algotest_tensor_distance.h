@@ -0,0 +1,160 @@
+/*  The Mathutil library
+ Copyright (C) 2007-2022 Maksym Davydov
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; version 3
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef algotest_tensor_distance_included
+#define algotest_tensor_distance_included
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "algotest_tensor.h"
+
+namespace algotest
+{
+    /// metrics of cdist
+    enum distance_metric
+    {
+        KDistanceL1,            ///< sum of absolute differences
+        KDistanceL2,            ///< euclidean distance
+        KDistanceSquaredL2,     ///< squared euclidean distance
+        KDistanceCosine,        ///< 1 - cosine similarity, zero vectors have distance 1
+        KDistanceInnerProduct   ///< dot product (a similarity, larger is closer)
+    };
+
+    /**
+     @brief tensor_distance computes distances between all pairs of rows of two matrices without
+     broadcasting them into a [N, M, D] temporary.
+     Metrics based on dot products are computed by tensor_gemm: ||a-b||^2 = ||a||^2 + ||b||^2 - 2ab,
+     then row norms are applied to the product. L1 walks blocks of rows of both matrices that fit the cache
+     and distributes pairs of blocks between threads.
+     */
+    class tensor_distance : public tensor_settings
+    {
+    public:
+        enum { KBlockBytes = 1<<15, KMinParallelWork = 64*64*64 };
+
+        /// squared euclidean norms of rows
+        template<class T>
+        static std::vector<T> squaredNorms(const vtensor<T>& x)
+        {
+            index_type rows = x.shape[0], d = x.shape[1], rs = x.stride(0), cs = x.stride(1);
+            std::vector<T> res( size_t(rows), T(0) );
+            const T * src = x.data();
+            sysutils::runForThreads(sysutils::KNumThreadsAuto, 0, rows, [&](int beg, int end)
+                {
+                    for(index_type i=beg; i<end; ++i)
+                    {
+                        T sum = 0;
+                        for(index_type k=0; k<d; ++k) sum += src[i*rs + k*cs]*src[i*rs + k*cs];
+                        res[i] = sum;
+                    }
+                });
+            return res;
+        }
+
+        template<class T>
+        static void l1(const vtensor<T>& a, const vtensor<T>& b, vtensor<T>& res)
+        {
+            const vtensor<T> pa = a.contiguous(), pb = b.contiguous();
+            index_type n = a.shape[0], m = b.shape[0], d = a.shape[1];
+            index_type block = std::max<index_type>(1, KBlockBytes/std::max<index_type>(1, d*index_type(sizeof(T))));
+            index_type row_blocks = (n + block - 1)/block, col_blocks = (m + block - 1)/block;
+            int num_threads = double(n)*m*d < double(KMinParallelWork) ? 1 : sysutils::KNumThreadsAuto;
+
+            const T * x = pa.data(), * y = pb.data();
+            T * dst = res.data();
+            sysutils::runForThreads(num_threads, 0, row_blocks*col_blocks, [&](int beg, int end)
+                {
+                    for(int tile=beg; tile<end; ++tile)
+                    {
+                        index_type ib = (tile / col_blocks)*block, jb = (tile % col_blocks)*block;
+                        for(index_type i=ib; i<std::min(n, ib+block); ++i)
+                        {
+                            for(index_type j=jb; j<std::min(m, jb+block); ++j)
+                            {
+                                const T * xi = x + i*d, * yj = y + j*d;
+                                T sum = 0;
+                                for(index_type k=0; k<d; ++k)
+                                {
+                                    T diff = xi[k] - yj[k];
+                                    sum += diff < T(0) ? -diff : diff;
+                                }
+                                dst[i*m + j] = sum;
+                            }
+                        }
+                    }
+                });
+        }
+
+        template<class T>
+        static tensor<T> cdist(const vtensor<T>& a, const vtensor<T>& b, distance_metric metric)
+        {
+            ASSERT(a.ndim()==2 && b.ndim()==2 && a.shape[1]==b.shape[1]);
+            index_type n = a.shape[0], m = b.shape[0], d = a.shape[1];
+            tensor<T> res( tensor_shape{n, m} );
+            if (metric==KDistanceL1)
+            {
+                l1(a, b, res);
+                return res;
+            }
+
+            tensor_gemm::multiply<T>(n, m, d, a.matrixRef(), b.matrixRef().transposed(), res.matrixRef());
+            if (metric==KDistanceInnerProduct) return res;
+
+            std::vector<T> na = squaredNorms(a), nb = squaredNorms(b);
+            if (metric==KDistanceCosine)
+            {
+                for(T& v : na) v = sqrt(v);
+                for(T& v : nb) v = sqrt(v);
+            }
+            T * dst = res.data();
+            sysutils::runForThreads(sysutils::KNumThreadsAuto, 0, n, [&](int beg, int end)
+                {
+                    for(index_type i=beg; i<end; ++i)
+                    {
+                        T * row = dst + i*m;
+                        switch(metric)
+                        {
+                            case KDistanceCosine:
+                                for(index_type j=0; j<m; ++j)
+                                {
+                                    T norms = na[i]*nb[j];
+                                    row[j] = norms > T(0) ? T(1) - row[j]/norms : T(1);
+                                }
+                                break;
+                            case KDistanceSquaredL2:
+                                for(index_type j=0; j<m; ++j) row[j] = std::max( T(0), na[i] + nb[j] - 2*row[j] );
+                                break;
+                            default:
+                                for(index_type j=0; j<m; ++j) row[j] = sqrt( std::max( T(0), na[i] + nb[j] - 2*row[j] ) );
+                        }
+                    }
+                });
+            return res;
+        }
+    };
+
+    /** @brief distances between all rows of a (N x D) and all rows of b (M x D), the result is N x M.
+     L2 distances of very close points lose precision because of the norm identity.
+    */
+    template<class T>
+    tensor<T> cdist(const vtensor<T>& a, const vtensor<T>& b, distance_metric metric = KDistanceL2)
+    {
+        return tensor_distance::cdist(a, b, metric);
+    }
+}
+
+#endif // algotest_tensor_distance_included
@@ -0,0 +1,334 @@
+/*  The Mathutil library
+ Copyright (C) 2007-2022 Maksym Davydov
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; version 3
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef algotest_tensor_einsum_included
+#define algotest_tensor_einsum_included
+
+#include <cctype>
+#include <limits>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include "algotest_tensor.h"
+
+namespace algotest
+{
+    /// operand of einsum: a tensor and the subscript label of every axis
+    template<class T>
+    struct einsum_operand
+    {
+        tensor<T> m_t;
+        std::string m_labels;
+    };
+
+    /**
+     @brief tensor_einsum evaluates Einstein summation by pairwise contractions.
+     Labels used by a single operand are summed out first, then the pair with the smallest
+     estimated cost (multiply-adds plus the size of the intermediate) is contracted until one operand is left.
+     A contraction is a batched tensor_gemm over permuted views (strides are passed to gemm, nothing is transposed),
+     products without free labels (dot products, elementwise products) are fused reductions of the apply engine.
+     */
+    class tensor_einsum : public tensor_settings
+    {
+    public:
+        typedef std::map<char, index_type> label_sizes;
+
+        /// splits "ij,jk->ik" into labels of the inputs and the output,
+        /// without "->" the output is the alphabetically sorted labels used exactly once
+        static std::vector<std::string> parse(const std::string& subscripts, std::string& output)
+        {
+            std::string spec;
+            for(char c : subscripts) if (!std::isspace((unsigned char)c)) spec += c;
+
+            size_t arrow = spec.find("->");
+            std::string lhs = spec.substr(0, arrow);
+            std::vector<std::string> inputs(1);
+            std::map<char, int> counts;
+            for(char c : lhs)
+            {
+                if (c==',') { inputs.emplace_back(); continue; }
+                ASSERT(std::isalpha((unsigned char)c));
+                inputs.back() += c;
+                ++counts[c];
+            }
+
+            output.clear();
+            if (arrow==std::string::npos)
+            {
+                for(const auto& c : counts) if (c.second==1) output += c.first;
+            }
+            else
+            {
+                output = spec.substr(arrow+2);
+                for(size_t i=0; i<output.size(); ++i)
+                {
+                    ASSERT(counts.count(output[i])>0);
+                    ASSERT(output.find(output[i], i+1)==std::string::npos);
+                }
+            }
+            return inputs;
+        }
+
+        static bool has(const std::string& labels, char c) { return labels.find(c)!=std::string::npos; }
+
+        /// number of elements spanned by the distinct labels
+        static double volume(const std::string& labels, const label_sizes& sizes)
+        {
+            double res = 1;
+            for(size_t i=0; i<labels.size(); ++i)
+            {
+                if (labels.find(labels[i])==i) res *= sizes.at(labels[i]);
+            }
+            return res;
+        }
+
+        /// labels of all operands except i and j
+        static std::string otherLabels(const std::vector<std::string>& labels, size_t i, size_t j)
+        {
+            std::string res;
+            for(size_t o=0; o<labels.size(); ++o) if (o!=i && o!=j) res += labels[o];
+            return res;
+        }
+
+        /// labels of the product of a and b when only labels of keep are needed later:
+        /// shared (batch) labels, then the rest of a, then the rest of b
+        static std::string resultLabels(const std::string& a, const std::string& b, const std::string& keep)
+        {
+            std::string batch, rest_a, rest_b;
+            for(char c : a) if (has(keep, c)) (has(b, c) ? batch : rest_a) += c;
+            for(char c : b) if (has(keep, c) && !has(a, c)) rest_b += c;
+            return batch + rest_a + rest_b;
+        }
+
+        /// greedy order of pairwise contractions, the contracted pair is removed and its result is appended
+        static std::vector< std::pair<int,int> > contractionOrder(std::vector<std::string> labels,
+                                                                  const std::string& output,
+                                                                  const label_sizes& sizes)
+        {
+            std::vector< std::pair<int,int> > order;
+            while(labels.size()>1)
+            {
+                double best_cost = std::numeric_limits<double>::max();
+                std::pair<int,int> best(0, 1);
+                std::string best_labels;
+                for(int i=0; i<int(labels.size()); ++i)
+                {
+                    for(int j=i+1; j<int(labels.size()); ++j)
+                    {
+                        std::string res = resultLabels(labels[i], labels[j], otherLabels(labels, i, j) + output);
+                        double cost = volume(labels[i] + labels[j], sizes) + volume(res, sizes);
+                        if (cost < best_cost) { best_cost = cost; best = {i, j}; best_labels = res; }
+                    }
+                }
+                order.push_back(best);
+                labels.erase(labels.begin() + best.second);
+                labels.erase(labels.begin() + best.first);
+                labels.push_back(best_labels);
+            }
+            return order;
+        }
+
+        /// positions of labels in op_labels, the permutation for vtensor::permute
+        static std::vector<int> axesOf(const std::string& labels, const std::string& op_labels)
+        {
+            std::vector<int> axes;
+            for(char c : labels) axes.push_back( int(op_labels.find(c)) );
+            return axes;
+        }
+
+        static tensor_shape shapeOf(const std::string& labels, const label_sizes& sizes)
+        {
+            std::vector<index_type> dims;
+            for(char c : labels) dims.push_back( sizes.at(c) );
+            return tensor_shape(dims);
+        }
+
+        /// takes diagonals of repeated labels and sums out labels missing in keep
+        template<class T>
+        static einsum_operand<T> reduce(einsum_operand<T> op, const std::string& keep)
+        {
+            for(int i=0; i<int(op.m_labels.size()); ++i)
+            {
+                for(int j=int(op.m_labels.size())-1; j>i; --j)
+                {
+                    if (op.m_labels[j]!=op.m_labels[i]) continue;
+                    op.m_t = op.m_t.diagonal(i, j);
+                    op.m_labels.erase(j, 1);
+                }
+            }
+            for(int i=int(op.m_labels.size())-1; i>=0; --i)
+            {
+                if (has(keep, op.m_labels[i])) continue;
+                if (op.m_t.ndim()==1) op.m_t = tensor<T>::scalar( op.m_t.sum() );
+                else op.m_t = op.m_t.sum(i);
+                op.m_labels.erase(i, 1);
+            }
+            return op;
+        }
+
+        /// contracts a and b keeping labels of keep, the result labels are resultLabels(a, b, keep)
+        template<class T>
+        static einsum_operand<T> contract(einsum_operand<T> a, einsum_operand<T> b,
+                                          const std::string& keep, const label_sizes& sizes)
+        {
+            a = reduce(a, b.m_labels + keep);
+            b = reduce(b, a.m_labels + keep);
+
+            std::string batch, rest_a, sum_labels, rest_b;
+            for(char c : a.m_labels) (has(b.m_labels, c) ? (has(keep, c) ? batch : sum_labels) : rest_a) += c;
+            for(char c : b.m_labels) if (!has(a.m_labels, c)) rest_b += c;
+
+            einsum_operand<T> res { tensor<T>( shapeOf(batch + rest_a + rest_b, sizes) ), batch + rest_a + rest_b };
+
+            if (rest_a.empty() && rest_b.empty())
+            {
+                // no free labels: res(batch) = sum over sum_labels of a*b
+                vtensor<T> av = a.m_t.permute( axesOf(batch + sum_labels, a.m_labels) );
+                vtensor<T> bv = b.m_t.permute( axesOf(batch + sum_labels, b.m_labels) );
+                multiplyReduce(res.m_t, av, bv, shapeOf(sum_labels, sizes));
+                return res;
+            }
+
+            int nb = int(batch.size()), na = int(rest_a.size()), nk = int(sum_labels.size());
+            tensor<T> av = a.m_t.permute( axesOf(batch + rest_a + sum_labels, a.m_labels) );
+            tensor<T> bv = b.m_t.permute( axesOf(batch + sum_labels + rest_b, b.m_labels) );
+            // grouped axes of a matrix need a single stride, otherwise the view is copied
+            if (!isUniform(av, nb, nb+na) || !isUniform(av, nb+na, av.ndim())) av = av.contiguous();
+            if (!isUniform(bv, nb, nb+nk) || !isUniform(bv, nb+nk, bv.ndim())) bv = bv.contiguous();
+
+            index_type m = index_type( volume(rest_a, sizes) );
+            index_type n = index_type( volume(rest_b, sizes) );
+            index_type k = index_type( volume(sum_labels, sizes) );
+
+            tensor_gemm::matrix_ref<const T> ar { std::as_const(av).data(), groupStride(av, nb, nb+na), groupStride(av, nb+na, av.ndim()) };
+            tensor_gemm::matrix_ref<const T> br { std::as_const(bv).data(), groupStride(bv, nb, nb+nk), groupStride(bv, nb+nk, bv.ndim()) };
+            tensor_gemm::matrix_ref<T> cr { res.m_t.data(), n, 1 };
+
+            index_type count = index_type( volume(batch, sizes) );
+            std::vector<tensor_gemm::batch_item> items;
+            items.reserve( static_cast<size_t>(count) );
+            std::vector<index_type> index( static_cast<size_t>(nb), 0 );
+            for(index_type t=0; t<count; ++t)
+            {
+                index_type da = 0, db = 0;
+                for(int i=0; i<nb; ++i) { da += index[i]*av.stride(i); db += index[i]*bv.stride(i); }
+                items.push_back( tensor_gemm::batch_item{ da, db, t*m*n } );
+                for(int i=nb-1; i>=0 && ++index[i]==av.shape[i]; --i) index[i] = 0;
+            }
+            tensor_gemm::multiplyBatched(items, m, n, k, ar, br, cr);
+            return res;
+        }
+
+    private:
+        /// axes [from, to) can be walked with the stride of the last of them
+        template<class T>
+        static bool isUniform(const vtensor<T>& t, int from, int to)
+        {
+            for(int i=from; i<to-1; ++i)
+            {
+                if (t.shape[i]>1 && t.stride(i) != t.shape[i+1]*t.stride(i+1)) return false;
+            }
+            return true;
+        }
+
+        template<class T>
+        static index_type groupStride(const vtensor<T>& t, int from, int to)
+        {
+            return from<to ? t.stride(to-1) : 0;
+        }
+
+        /// res(batch) = sum of a(batch, sum)*b(batch, sum) in a single pass of the apply engine
+        template<class T>
+        static void multiplyReduce(tensor<T>& res, const vtensor<T>& a, const vtensor<T>& b, const tensor_shape& sum_shape)
+        {
+            if (res.ndim()==0)
+            {
+                T sum = 0;
+                if (sum_shape.ndim()==0) sum = *a.data() * *b.data();
+                else a.apply(b, [&sum](const T& x, const T& y) { sum += x*y; });
+                *res.data() = sum;
+            }
+            else if (sum_shape.ndim()==0)
+            {
+                res.apply_parallel(a, b, [](T& r, const T& x, const T& y) { r = x*y; });
+            }
+            else
+            {
+                res.init(T(0));
+                res.replicateValues(sum_shape).apply_parallel(a, b, [](T& r, const T& x, const T& y) { r += x*y; });
+            }
+        }
+    };
+
+    /** @brief Einstein summation, einsum("bij,bjk->bik", a, b) is a batched matrix product.
+     Repeated labels of an operand take the diagonal ("ii->i"), labels missing in the output are summed.
+     Without "->" the output is the alphabetically sorted labels used once, as in numpy.
+     The order of pairwise contractions is chosen by tensor_einsum::contractionOrder.
+    */
+    template<class T>
+    tensor<T> einsum(const std::string& subscripts, const std::vector< vtensor<T> >& operands)
+    {
+        std::string output;
+        std::vector<std::string> labels = tensor_einsum::parse(subscripts, output);
+        ASSERT(labels.size()==operands.size());
+
+        tensor_einsum::label_sizes sizes;
+        std::vector< einsum_operand<T> > ops;
+        for(size_t i=0; i<operands.size(); ++i)
+        {
+            ASSERT(int(labels[i].size())==operands[i].ndim());
+            for(int axis=0; axis<operands[i].ndim(); ++axis)
+            {
+                auto it = sizes.find(labels[i][axis]);
+                if (it==sizes.end()) sizes[labels[i][axis]] = operands[i].shape[axis];
+                else ASSERT(it->second==operands[i].shape[axis]);
+            }
+            ops.push_back( einsum_operand<T>{ tensor<T>(operands[i]), labels[i] } );
+        }
+
+        for(size_t i=0; i<ops.size(); ++i)
+        {
+            ops[i] = tensor_einsum::reduce(ops[i], tensor_einsum::otherLabels(labels, i, i) + output);
+            labels[i] = ops[i].m_labels;
+        }
+
+        for(const auto& step : tensor_einsum::contractionOrder(labels, output, sizes))
+        {
+            std::string keep = tensor_einsum::otherLabels(labels, step.first, step.second) + output;
+            einsum_operand<T> res = tensor_einsum::contract(ops[step.first], ops[step.second], keep, sizes);
+            ops.erase(ops.begin() + step.second);
+            ops.erase(ops.begin() + step.first);
+            ops.push_back(res);
+            labels.erase(labels.begin() + step.second);
+            labels.erase(labels.begin() + step.first);
+            labels.push_back(res.m_labels);
+        }
+
+        einsum_operand<T> res = tensor_einsum::reduce(ops[0], output);
+        tensor<T> permuted = res.m_t.permute( tensor_einsum::axesOf(output, res.m_labels) );
+        // a single operand may still be a view of the input
+        return operands.size()==1 ? tensor<T>(permuted.deepCopy()) : tensor<T>(permuted.sequential());
+    }
+
+    template<class T, class... Tensors>
+    tensor<T> einsum(const std::string& subscripts, const vtensor<T>& first, const Tensors&... rest)
+    {
+        return einsum(subscripts, std::vector< vtensor<T> >{ first, rest... });
+    }
+}
+
+#endif // algotest_tensor_einsum_included
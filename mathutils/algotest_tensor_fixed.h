@@ -0,0 +1,491 @@
+/*  The Mathutil library
+ Copyright (C) 2007-2022 Maksym Davydov
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; version 3
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef algotest_tensor_fixed_included
+#define algotest_tensor_fixed_included
+
+#include <algorithm>
+#include <cmath>
+#include <initializer_list>
+#include <type_traits>
+#include <utility>
+#include "algotest_tensor.h"
+
+namespace algotest
+{
+    /**
+     @brief fixed_tensor_ops holds helpers of the fixed-size tensor<T,N> and tensor<T,N,M>.
+     Loops over compile-time sizes are unrolled by fixed_tensor_ops::unroll, determinants and inverses
+     up to 4x4 use closed formulas, larger matrices use Gauss-Jordan elimination on the stack.
+     */
+    class fixed_tensor_ops : public tensor_settings
+    {
+    public:
+        enum { KMaxUnroll = 16, KSoABlock = 256 };
+
+        /// calls f(integral_constant<int, i>) for i in [0, N), unrolled for small N
+        template<int N, class F>
+        static inline void unroll(F&& f)
+        {
+            if constexpr (N <= KMaxUnroll)
+            {
+                [&]<int... I>(std::integer_sequence<int, I...>) { (f(std::integral_constant<int, I>()), ...); }
+                    (std::make_integer_sequence<int, N>());
+            }
+            else
+            {
+                for(int i=0; i<N; ++i) f(i);
+            }
+        }
+
+        /// alignment that lets the compiler use aligned vector loads for the whole array
+        template<class T, int Size>
+        static constexpr size_t alignment()
+        {
+            constexpr size_t bytes = sizeof(T)*Size;
+            return bytes%32==0 ? 32 : bytes%16==0 ? 16 : alignof(T);
+        }
+
+        /// determinant of the row-major N x N matrix a
+        template<class T, int N>
+        static T det(const T * a)
+        {
+            if constexpr (N==1) return a[0];
+            else if constexpr (N==2) return a[0]*a[3] - a[1]*a[2];
+            else if constexpr (N==3)
+            {
+                return a[0]*(a[4]*a[8] - a[5]*a[7]) - a[1]*(a[3]*a[8] - a[5]*a[6]) + a[2]*(a[3]*a[7] - a[4]*a[6]);
+            }
+            else if constexpr (N==4)
+            {
+                T s[6], c[6];
+                minors4(a, s, c);
+                return s[0]*c[5] - s[1]*c[4] + s[2]*c[3] + s[3]*c[2] - s[4]*c[1] + s[5]*c[0];
+            }
+            else
+            {
+                T m[N*N];
+                std::copy(a, a+N*N, m);
+                T res = 1;
+                for(int k=0; k<N; ++k)
+                {
+                    int p = pivotRow<T, N>(m, k);
+                    if (m[p*N+k]==T(0)) return T(0);
+                    if (p!=k) { std::swap_ranges(m+p*N, m+p*N+N, m+k*N); res = -res; }
+                    res *= m[k*N+k];
+                    for(int i=k+1; i<N; ++i)
+                    {
+                        T f = m[i*N+k]/m[k*N+k];
+                        for(int j=k; j<N; ++j) m[i*N+j] -= f*m[k*N+j];
+                    }
+                }
+                return res;
+            }
+        }
+
+        /// inverse of the row-major N x N matrix a into res, returns false for a singular matrix
+        template<class T, int N>
+        static bool invert(const T * a, T * res)
+        {
+            if constexpr (N<=4)
+            {
+                T d = det<T, N>(a);
+                if (d==T(0)) return false;
+                T r = T(1)/d;
+                if constexpr (N==1) res[0] = r;
+                else if constexpr (N==2)
+                {
+                    res[0] = a[3]*r;  res[1] = -a[1]*r;
+                    res[2] = -a[2]*r; res[3] = a[0]*r;
+                }
+                else if constexpr (N==3)
+                {
+                    res[0] = (a[4]*a[8] - a[5]*a[7])*r; res[1] = (a[2]*a[7] - a[1]*a[8])*r; res[2] = (a[1]*a[5] - a[2]*a[4])*r;
+                    res[3] = (a[5]*a[6] - a[3]*a[8])*r; res[4] = (a[0]*a[8] - a[2]*a[6])*r; res[5] = (a[2]*a[3] - a[0]*a[5])*r;
+                    res[6] = (a[3]*a[7] - a[4]*a[6])*r; res[7] = (a[1]*a[6] - a[0]*a[7])*r; res[8] = (a[0]*a[4] - a[1]*a[3])*r;
+                }
+                else
+                {
+                    T s[6], c[6];
+                    minors4(a, s, c);
+                    res[0]  = ( a[5]*c[5]  - a[6]*c[4]  + a[7]*c[3])*r;
+                    res[1]  = (-a[1]*c[5]  + a[2]*c[4]  - a[3]*c[3])*r;
+                    res[2]  = ( a[13]*s[5] - a[14]*s[4] + a[15]*s[3])*r;
+                    res[3]  = (-a[9]*s[5]  + a[10]*s[4] - a[11]*s[3])*r;
+                    res[4]  = (-a[4]*c[5]  + a[6]*c[2]  - a[7]*c[1])*r;
+                    res[5]  = ( a[0]*c[5]  - a[2]*c[2]  + a[3]*c[1])*r;
+                    res[6]  = (-a[12]*s[5] + a[14]*s[2] - a[15]*s[1])*r;
+                    res[7]  = ( a[8]*s[5]  - a[10]*s[2] + a[11]*s[1])*r;
+                    res[8]  = ( a[4]*c[4]  - a[5]*c[2]  + a[7]*c[0])*r;
+                    res[9]  = (-a[0]*c[4]  + a[1]*c[2]  - a[3]*c[0])*r;
+                    res[10] = ( a[12]*s[4] - a[13]*s[2] + a[15]*s[0])*r;
+                    res[11] = (-a[8]*s[4]  + a[9]*s[2]  - a[11]*s[0])*r;
+                    res[12] = (-a[4]*c[3]  + a[5]*c[1]  - a[6]*c[0])*r;
+                    res[13] = ( a[0]*c[3]  - a[1]*c[1]  + a[2]*c[0])*r;
+                    res[14] = (-a[12]*s[3] + a[13]*s[1] - a[14]*s[0])*r;
+                    res[15] = ( a[8]*s[3]  - a[9]*s[1]  + a[10]*s[0])*r;
+                }
+                return true;
+            }
+            else
+            {
+                // Gauss-Jordan elimination with partial pivoting
+                T m[N*N];
+                std::copy(a, a+N*N, m);
+                std::fill(res, res+N*N, T(0));
+                for(int i=0; i<N; ++i) res[i*N+i] = T(1);
+                for(int k=0; k<N; ++k)
+                {
+                    int p = pivotRow<T, N>(m, k);
+                    if (m[p*N+k]==T(0)) return false;
+                    if (p!=k)
+                    {
+                        std::swap_ranges(m+p*N, m+p*N+N, m+k*N);
+                        std::swap_ranges(res+p*N, res+p*N+N, res+k*N);
+                    }
+                    T r = T(1)/m[k*N+k];
+                    for(int j=0; j<N; ++j) { m[k*N+j] *= r; res[k*N+j] *= r; }
+                    for(int i=0; i<N; ++i)
+                    {
+                        if (i==k) continue;
+                        T f = m[i*N+k];
+                        for(int j=0; j<N; ++j) { m[i*N+j] -= f*m[k*N+j]; res[i*N+j] -= f*res[k*N+j]; }
+                    }
+                }
+                return true;
+            }
+        }
+
+    private:
+        /// 2x2 minors of rows 0,1 (s) and rows 2,3 (c) of a 4x4 matrix
+        template<class T>
+        static void minors4(const T * a, T * s, T * c)
+        {
+            s[0] = a[0]*a[5] - a[4]*a[1];   c[0] = a[8]*a[13] - a[12]*a[9];
+            s[1] = a[0]*a[6] - a[4]*a[2];   c[1] = a[8]*a[14] - a[12]*a[10];
+            s[2] = a[0]*a[7] - a[4]*a[3];   c[2] = a[8]*a[15] - a[12]*a[11];
+            s[3] = a[1]*a[6] - a[5]*a[2];   c[3] = a[9]*a[14] - a[13]*a[10];
+            s[4] = a[1]*a[7] - a[5]*a[3];   c[4] = a[9]*a[15] - a[13]*a[11];
+            s[5] = a[2]*a[7] - a[6]*a[3];   c[5] = a[10]*a[15] - a[14]*a[11];
+        }
+
+        template<class T, int N>
+        static int pivotRow(const T * m, int k)
+        {
+            int p = k;
+            for(int i=k+1; i<N; ++i) if (std::abs(m[i*N+k]) > std::abs(m[p*N+k])) p = i;
+            return p;
+        }
+    };
+
+    /**
+     @brief fixed-size vector, values are stored in place (no heap, no shape or strides).
+    */
+    template<class T, int N>
+    class tensor<T, N>
+    {
+    public:
+        enum { KSize = N };
+        alignas(fixed_tensor_ops::alignment<T, N>()) T m_v[N];
+
+        tensor() : m_v{} {}
+        tensor(const std::initializer_list<T>& values)
+        {
+            ASSERT(values.size()==N);
+            std::copy(values.begin(), values.end(), m_v);
+        }
+        explicit tensor(const vtensor<T>& t)
+        {
+            ASSERT(t.ndim()==1 && t.shape[0]==N);
+            for(int i=0; i<N; ++i) m_v[i] = t[{i}];
+        }
+
+        operator tensor<T>() const
+        {
+            tensor<T> res({N});
+            std::copy(m_v, m_v+N, res.data());
+            return res;
+        }
+
+        T& operator[](int i) { return m_v[i]; }
+        const T& operator[](int i) const { return m_v[i]; }
+        T& operator()(int i) { return m_v[i]; }
+        const T& operator()(int i) const { return m_v[i]; }
+        T * data() { return m_v; }
+        const T * data() const { return m_v; }
+
+        bool operator==(const tensor& o) const { return std::equal(m_v, m_v+N, o.m_v); }
+        bool operator!=(const tensor& o) const { return !(*this==o); }
+
+        tensor operator+(const tensor& o) const { tensor r; fixed_tensor_ops::unroll<N>([&](auto i) { r.m_v[i] = m_v[i] + o.m_v[i]; }); return r; }
+        tensor operator-(const tensor& o) const { tensor r; fixed_tensor_ops::unroll<N>([&](auto i) { r.m_v[i] = m_v[i] - o.m_v[i]; }); return r; }
+        tensor operator*(const T& s) const { tensor r; fixed_tensor_ops::unroll<N>([&](auto i) { r.m_v[i] = m_v[i]*s; }); return r; }
+
+        T dot(const tensor& o) const
+        {
+            T res = 0;
+            fixed_tensor_ops::unroll<N>([&](auto i) { res += m_v[i]*o.m_v[i]; });
+            return res;
+        }
+        T norm() const { return std::sqrt(dot(*this)); }
+
+        bool allclose(const tensor& o, const T& eps) const
+        {
+            for(int i=0; i<N; ++i) if (std::abs(m_v[i]-o.m_v[i]) > eps) return false;
+            return true;
+        }
+    };
+
+    /**
+     @brief fixed-size row-major N x M matrix with compile-time dimensions, stored in place and aligned
+     for vector loads. Products, determinants and inverses are unrolled for small sizes.
+     Converts to and from the dynamic tensor<T>.
+    */
+    template<class T, int N, int M>
+    class tensor<T, N, M>
+    {
+    public:
+        enum { KRows = N, KCols = M, KSize = N*M };
+        alignas(fixed_tensor_ops::alignment<T, N*M>()) T m_v[N*M];
+
+        tensor() : m_v{} {}
+        tensor(const std::initializer_list<T>& values)
+        {
+            ASSERT(values.size()==KSize);
+            std::copy(values.begin(), values.end(), m_v);
+        }
+        explicit tensor(const vtensor<T>& t)
+        {
+            ASSERT(t.ndim()==2 && t.shape[0]==N && t.shape[1]==M);
+            for(int i=0; i<N; ++i) for(int j=0; j<M; ++j) m_v[i*M+j] = t[{i,j}];
+        }
+        /// initializes element (i,j) by f(i,j)
+        template<class F, class = std::enable_if_t< std::is_invocable_v<F, int, int> &&
+                                                    !std::is_base_of_v< vtensor<T>, std::decay_t<F> > > >
+        explicit tensor(F&& f)
+        {
+            for(int i=0; i<N; ++i) for(int j=0; j<M; ++j) m_v[i*M+j] = T( f(i, j) );
+        }
+
+        static tensor zeros() { return tensor(); }
+        static tensor identity()
+        {
+            static_assert(N==M, "identity matrix should be square");
+            tensor res;
+            fixed_tensor_ops::unroll<N>([&](auto i) { res.m_v[i*M+i] = T(1); });
+            return res;
+        }
+        static tensor random(const T& from, const T& to)
+        {
+            return tensor( tensor<T>::random({N, M}, from, to) );
+        }
+
+        operator tensor<T>() const
+        {
+            tensor<T> res({N, M});
+            std::copy(m_v, m_v+KSize, res.data());
+            return res;
+        }
+
+        T& operator()(int i, int j) { return m_v[i*M+j]; }
+        const T& operator()(int i, int j) const { return m_v[i*M+j]; }
+        T * data() { return m_v; }
+        const T * data() const { return m_v; }
+
+        bool operator==(const tensor& o) const { return std::equal(m_v, m_v+KSize, o.m_v); }
+        bool operator!=(const tensor& o) const { return !(*this==o); }
+
+        tensor operator+(const tensor& o) const { tensor r; fixed_tensor_ops::unroll<KSize>([&](auto i) { r.m_v[i] = m_v[i] + o.m_v[i]; }); return r; }
+        tensor operator-(const tensor& o) const { tensor r; fixed_tensor_ops::unroll<KSize>([&](auto i) { r.m_v[i] = m_v[i] - o.m_v[i]; }); return r; }
+        tensor operator*(const T& s) const { tensor r; fixed_tensor_ops::unroll<KSize>([&](auto i) { r.m_v[i] = m_v[i]*s; }); return r; }
+
+        template<int K>
+        tensor<T, N, K> operator*(const tensor<T, M, K>& b) const
+        {
+            tensor<T, N, K> res;
+            fixed_tensor_ops::unroll<N>([&](auto i)
+                {
+                    fixed_tensor_ops::unroll<M>([&](auto j)
+                        {
+                            T a = m_v[i*M+j];
+                            fixed_tensor_ops::unroll<K>([&](auto k) { res.m_v[i*K+k] += a*b.m_v[j*K+k]; });
+                        });
+                });
+            return res;
+        }
+
+        tensor<T, N> operator*(const tensor<T, M>& v) const
+        {
+            tensor<T, N> res;
+            fixed_tensor_ops::unroll<N>([&](auto i)
+                {
+                    T sum = 0;
+                    fixed_tensor_ops::unroll<M>([&](auto j) { sum += m_v[i*M+j]*v.m_v[j]; });
+                    res.m_v[i] = sum;
+                });
+            return res;
+        }
+
+        tensor<T, M, N> transpose() const
+        {
+            tensor<T, M, N> res;
+            for(int i=0; i<N; ++i) for(int j=0; j<M; ++j) res.m_v[j*N+i] = m_v[i*M+j];
+            return res;
+        }
+
+        T det() const
+        {
+            static_assert(N==M, "determinant requires a square matrix");
+            return fixed_tensor_ops::det<T, N>(m_v);
+        }
+
+        /// inverse matrix, the matrix should not be singular
+        tensor inverse() const
+        {
+            static_assert(N==M, "inverse requires a square matrix");
+            tensor res;
+            bool ok = fixed_tensor_ops::invert<T, N>(m_v, res.m_v);
+            ASSERT(ok);
+            return res;
+        }
+
+        bool allclose(const tensor& o, const T& eps) const
+        {
+            for(int i=0; i<KSize; ++i) if (std::abs(m_v[i]-o.m_v[i]) > eps) return false;
+            return true;
+        }
+        bool isIdentity(const T& eps = T(0)) const
+        {
+            static_assert(N==M, "identity matrix should be square");
+            return allclose(identity(), eps);
+        }
+    };
+
+    template<class T, int N>
+    T det(const tensor<T, N, N>& m) { return m.det(); }
+
+    template<class T, int N>
+    tensor<T, N, N> inverse(const tensor<T, N, N>& m) { return m.inverse(); }
+
+    /**
+     @brief fixed_transform applies a fixed-size matrix to many points stored in a dynamic tensor.
+     A point has M coordinates, or M-1 coordinates for an affine transform (homogeneous w=1 is implied,
+     the last row of the matrix is not used and the result has N-1 coordinates).
+     AoS layout keeps a point per row (P x D), the unrolled matrix is applied to each point.
+     SoA layout keeps a coordinate per row (D x P), every output row is accumulated over blocks of points,
+     so the inner loops run over contiguous points and vectorize.
+     */
+    class fixed_transform : public tensor_settings
+    {
+    public:
+        template<class T, int N, int M>
+        static tensor<T> aos(const tensor<T, N, M>& m, const vtensor<T>& points)
+        {
+            ASSERT(points.ndim()==2);
+            bool affine = points.shape[1]==M-1;
+            ASSERT(affine || points.shape[1]==M);
+
+            index_type count = points.shape[0];
+            tensor<T> res({ count, affine ? N-1 : N });
+            const T * src = points.data();
+            T * dst = res.data();
+            index_type ps = points.stride(0), cs = points.stride(1);
+
+            sysutils::runForThreads(sysutils::KNumThreadsAuto, 0, count, [&](int beg, int end)
+                {
+                    for(index_type p=beg; p<end; ++p)
+                    {
+                        const T * in = src + p*ps;
+                        if (affine) point<T, N-1, M, true>(m, in, cs, dst + p*(N-1), 1);
+                        else        point<T, N, M, false>(m, in, cs, dst + p*N, 1);
+                    }
+                });
+            return res;
+        }
+
+        template<class T, int N, int M>
+        static tensor<T> soa(const tensor<T, N, M>& m, const vtensor<T>& points)
+        {
+            ASSERT(points.ndim()==2);
+            bool affine = points.shape[0]==M-1;
+            ASSERT(affine || points.shape[0]==M);
+
+            index_type count = points.shape[1];
+            int out_dims = affine ? N-1 : N, in_dims = affine ? M-1 : M;
+            tensor<T> res({ out_dims, count });
+            const T * src = points.data();
+            T * dst = res.data();
+            index_type cs = points.stride(0), ps = points.stride(1);
+
+            index_type num_blocks = (count + KSoABlock - 1)/KSoABlock;
+            sysutils::runForThreads(sysutils::KNumThreadsAuto, 0, num_blocks, [&](int beg, int end)
+                {
+                    for(index_type b=beg; b<end; ++b)
+                    {
+                        index_type p0 = b*KSoABlock, n = std::min<index_type>(KSoABlock, count-p0);
+                        for(int i=0; i<out_dims; ++i)
+                        {
+                            T * out = dst + i*count + p0;
+                            T t = affine ? m(i, M-1) : T(0);
+                            for(index_type p=0; p<n; ++p) out[p] = t;
+                            for(int j=0; j<in_dims; ++j)
+                            {
+                                T a = m(i, j);
+                                const T * in = src + j*cs + p0*ps;
+                                if (ps==1) for(index_type p=0; p<n; ++p) out[p] += a*in[p];
+                                else       for(index_type p=0; p<n; ++p) out[p] += a*in[p*ps];
+                            }
+                        }
+                    }
+                });
+            return res;
+        }
+
+    private:
+        enum { KSoABlock = fixed_tensor_ops::KSoABlock };
+
+        /// out[i*os] = sum_j m(i,j)*in[j*is] (+ m(i,M-1) for affine) for i < R
+        template<class T, int R, int M, bool Affine>
+        static inline void point(const tensor<T, R + (Affine ? 1 : 0), M>& m, const T * in, index_type is, T * out, index_type os)
+        {
+            enum { C = Affine ? M-1 : M };
+            T x[C];
+            fixed_tensor_ops::unroll<C>([&](auto j) { x[j] = in[j*is]; });
+            fixed_tensor_ops::unroll<R>([&](auto i)
+                {
+                    T sum = Affine ? m(i, M-1) : T(0);
+                    fixed_tensor_ops::unroll<C>([&](auto j) { sum += m(i, j)*x[j]; });
+                    out[i*os] = sum;
+                });
+        }
+    };
+
+    /// applies m to points of P x D tensor (a point per row), see fixed_transform
+    template<class T, int N, int M>
+    tensor<T> transform_points(const tensor<T, N, M>& m, const vtensor<T>& points)
+    {
+        return fixed_transform::aos(m, points);
+    }
+
+    /// applies m to points of D x P tensor (a coordinate per row), see fixed_transform
+    template<class T, int N, int M>
+    tensor<T> transform_points_soa(const tensor<T, N, M>& m, const vtensor<T>& points)
+    {
+        return fixed_transform::soa(m, points);
+    }
+}
+
+#endif // algotest_tensor_fixed_included
@@ -0,0 +1,258 @@
+/*  The Mathutil library
+ Copyright (C) 2007-2022 Maksym Davydov
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; version 3
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef algotest_tensor_gemm_included
+#define algotest_tensor_gemm_included
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "algotest_tensor_impl.h"
+
+#if defined __clang__ || defined __GNUC__
+    #define ALGOTEST_GEMM_VECTOR_EXTENSIONS 1
+#endif
+
+namespace algotest
+{
+    /// register and cache blocking of the gemm micro-kernel for the accumulation type U
+    template<class U> struct gemm_blocking { enum { KMR = 4, KNR = 8, KVectorBytes = 0 }; };
+    template<> struct gemm_blocking<float> { enum { KMR = 6, KNR = 16, KVectorBytes = 32 }; };
+    template<> struct gemm_blocking<double> { enum { KMR = 6, KNR = 8, KVectorBytes = 32 }; };
+
+#ifdef ALGOTEST_GEMM_VECTOR_EXTENSIONS
+    template<class U> struct gemm_vector {};
+    template<> struct gemm_vector<float> { typedef float type __attribute__((vector_size(32))); };
+    template<> struct gemm_vector<double> { typedef double type __attribute__((vector_size(32))); };
+#endif
+
+    /// how the product is written into C
+    enum gemm_mode { KGemmSet, KGemmAdd, KGemmSubtract };
+
+    /**
+     @brief tensor_gemm computes C = A*B for strided matrices.
+     A and B are packed by cache-sized blocks into contiguous panels (converting values to the result type),
+     so any strides work equally fast, including transposed and broadcast (0-stride) views.
+     Every output tile is computed by a register-blocked micro-kernel, tiles are distributed between threads.
+     */
+    class tensor_gemm : public tensor_settings
+    {
+    public:
+        enum { KC = 256, KMaxCachedK = 4096, KMinParallelWork = 64*64*64 };
+
+        /// strided matrix view: element (i,j) is at m_ptr[i*m_rs + j*m_cs]
+        template<class T>
+        struct matrix_ref
+        {
+            T * m_ptr;
+            index_type m_rs;
+            index_type m_cs;
+
+            T& operator()(index_type i, index_type j, index_type displace = 0) const { return m_ptr[displace + i*m_rs + j*m_cs]; }
+            matrix_ref displaced(index_type displace) const { return matrix_ref{ m_ptr + displace, m_rs, m_cs }; }
+            matrix_ref transposed() const { return matrix_ref{ m_ptr, m_cs, m_rs }; }
+        };
+
+        /// displacements of one product of a batch from the matrices passed to multiplyBatched
+        struct batch_item
+        {
+            index_type m_a;
+            index_type m_b;
+            index_type m_c;
+        };
+
+        /// C(m x n) = A(m x k) * B(k x n), C += A*B or C -= A*B depending on mode
+        template<class U, class TA, class TB>
+        static void multiply(index_type m, index_type n, index_type k,
+                             matrix_ref<TA> a, matrix_ref<TB> b, matrix_ref<U> c,
+                             gemm_mode mode = KGemmSet, int num_threads = sysutils::KNumThreadsAuto)
+        {
+            multiplyBatched(std::vector<batch_item>(1, batch_item{0, 0, 0}), m, n, k, a, b, c, mode, num_threads);
+        }
+
+        /** @brief computes C = A*B for every item of the batch (matrices are displaced by the item).
+         Output tiles of all products are distributed between threads together,
+         so a batch of small matrices loads all threads as well as one large product.
+         Items may share A or B (broadcasting), but they should not share C.
+        */
+        template<class U, class TA, class TB>
+        static void multiplyBatched(const std::vector<batch_item>& items,
+                                    index_type m, index_type n, index_type k,
+                                    matrix_ref<TA> a, matrix_ref<TB> b, matrix_ref<U> c,
+                                    gemm_mode mode = KGemmSet, int num_threads = sysutils::KNumThreadsAuto)
+        {
+            enum { MR = gemm_blocking<U>::KMR, NR = gemm_blocking<U>::KNR };
+            enum { MC = MR*16, NCG = NR*8 };
+
+            if (items.empty() || m==0 || n==0) return;
+            if (k==0)
+            {
+                if (mode!=KGemmSet) return;
+                for(const batch_item& item : items)
+                {
+                    for(index_type i=0; i<m; ++i) for(index_type j=0; j<n; ++j) c(i,j, item.m_c) = U(0);
+                }
+                return;
+            }
+
+            if (double(items.size())*m*n*k < double(KMinParallelWork)) num_threads = 1;
+
+            index_type num_row_blocks = (m + MC - 1)/MC;
+            index_type num_col_groups = (n + NCG - 1)/NCG;
+            index_type tiles_per_item = num_row_blocks*num_col_groups;
+            index_type num_tiles = index_type(items.size())*tiles_per_item;
+
+            // packed B of the whole k range is kept while consecutive tiles use the same columns
+            bool cache_b = k <= KMaxCachedK;
+
+            sysutils::runForThreads(num_threads, 0, num_tiles, [&](int beg, int end)
+                {
+                    std::vector<U> packed_a( size_t(MC)*KC );
+                    std::vector<U> packed_b( size_t(cache_b ? k : KC)*NCG );
+                    index_type packed_b_item = -1, packed_b_col = -1;
+
+                    for(int t=beg; t<end; ++t)
+                    {
+                        const batch_item& item = items[t / tiles_per_item];
+                        index_type tile = t % tiles_per_item;
+                        index_type jc = (tile / num_row_blocks)*NCG;
+                        index_type ic = (tile % num_row_blocks)*MC;
+                        index_type mc = std::min<index_type>(MC, m-ic);
+                        index_type nc = std::min<index_type>(NCG, n-jc);
+
+                        matrix_ref<TA> ai = a.displaced(item.m_a);
+                        matrix_ref<TB> bi = b.displaced(item.m_b).transposed();
+                        matrix_ref<U> ci = c.displaced(item.m_c);
+
+                        bool pack_b = !cache_b || packed_b_item!=item.m_b || packed_b_col!=jc;
+                        packed_b_item = item.m_b;
+                        packed_b_col = jc;
+
+                        for(index_type pc=0; pc<k; pc+=KC)
+                        {
+                            index_type kc = std::min<index_type>(KC, k-pc);
+                            U * pb = packed_b.data() + (cache_b ? size_t(pc)*NCG : 0);
+
+                            for(index_type ir=0; ir<mc; ir+=MR)
+                            {
+                                packPanel<MR>(packed_a.data() + size_t(ir)*kc, ai, ic + ir, std::min<index_type>(MR, mc-ir), pc, kc);
+                            }
+                            if (pack_b)
+                            {
+                                for(index_type jr=0; jr<nc; jr+=NR)
+                                {
+                                    packPanel<NR>(pb + size_t(jr)*kc, bi, jc + jr, std::min<index_type>(NR, nc-jr), pc, kc);
+                                }
+                            }
+
+                            for(index_type jr=0; jr<nc; jr+=NR)
+                            {
+                                for(index_type ir=0; ir<mc; ir+=MR)
+                                {
+                                    U acc[MR*NR];
+                                    microKernel<U, MR, NR>(kc, packed_a.data() + size_t(ir)*kc, pb + size_t(jr)*kc, acc);
+                                    storeTile<U, MR, NR>(acc, ci, ic + ir, jc + jr,
+                                                         std::min<index_type>(MR, mc-ir), std::min<index_type>(NR, nc-jr),
+                                                         pc>0 && mode==KGemmSet ? KGemmAdd : mode);
+                                }
+                            }
+                        }
+                    }
+                });
+        }
+
+    private:
+        /// packs rows [row, row+rows) and columns [col, col+kc) of a into dst[kk*R + i], missing rows are zeros
+        template<int R, class U, class T>
+        static void packPanel(U * dst, const matrix_ref<T>& a, index_type row, index_type rows, index_type col, index_type kc)
+        {
+            if (rows<R) std::fill(dst, dst + size_t(kc)*R, U(0));
+
+            // follow the smaller stride in the inner loop
+            if (std::abs(a.m_cs) <= std::abs(a.m_rs))
+            {
+                for(index_type i=0; i<rows; ++i)
+                {
+                    const T * src = &a(row+i, col);
+                    for(index_type kk=0; kk<kc; ++kk) dst[kk*R + i] = U(src[kk*a.m_cs]);
+                }
+            }
+            else
+            {
+                for(index_type kk=0; kk<kc; ++kk)
+                {
+                    const T * src = &a(row, col+kk);
+                    for(index_type i=0; i<rows; ++i) dst[kk*R + i] = U(src[i*a.m_rs]);
+                }
+            }
+        }
+
+        /// acc(MR x NR) = packed panel of A (kc x MR) * packed panel of B (kc x NR)
+        template<class U, int MR, int NR>
+        static void microKernel(index_type kc, const U * a, const U * b, U * acc)
+        {
+#ifdef ALGOTEST_GEMM_VECTOR_EXTENSIONS
+            if constexpr (gemm_blocking<U>::KVectorBytes > 0)
+            {
+                typedef typename gemm_vector<U>::type vec;
+                enum { NV = NR*sizeof(U)/sizeof(vec) };
+                static_assert(NV*sizeof(vec) == NR*sizeof(U));
+
+                vec c[MR][NV] = {};
+                for(index_type kk=0; kk<kc; ++kk, a+=MR, b+=NR)
+                {
+                    vec bv[NV];
+                    memcpy(bv, b, sizeof(bv));
+                    for(int i=0; i<MR; ++i)
+                    {
+                        for(int v=0; v<NV; ++v) c[i][v] += a[i]*bv[v];
+                    }
+                }
+                memcpy(acc, c, sizeof(c));
+                return;
+            }
+#endif
+            std::fill(acc, acc + MR*NR, U(0));
+            for(index_type kk=0; kk<kc; ++kk, a+=MR, b+=NR)
+            {
+                for(int i=0; i<MR; ++i)
+                {
+                    U ai = a[i];
+                    for(int j=0; j<NR; ++j) acc[i*NR + j] += ai*b[j];
+                }
+            }
+        }
+
+        template<class U, int MR, int NR>
+        static void storeTile(const U * acc, const matrix_ref<U>& c, index_type row, index_type col,
+                              index_type rows, index_type cols, gemm_mode mode)
+        {
+            for(index_type i=0; i<rows; ++i)
+            {
+                U * dst = &c(row+i, col);
+                switch(mode)
+                {
+                    case KGemmSet:      for(index_type j=0; j<cols; ++j) dst[j*c.m_cs] = acc[i*NR + j]; break;
+                    case KGemmAdd:      for(index_type j=0; j<cols; ++j) dst[j*c.m_cs] += acc[i*NR + j]; break;
+                    case KGemmSubtract: for(index_type j=0; j<cols; ++j) dst[j*c.m_cs] -= acc[i*NR + j]; break;
+                }
+            }
+        }
+    };
+}
+
+#endif // algotest_tensor_gemm_included
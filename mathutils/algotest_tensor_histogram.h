@@ -0,0 +1,196 @@
+/*  The Mathutil library
+ Copyright (C) 2007-2022 Maksym Davydov
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; version 3
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef algotest_tensor_histogram_included
+#define algotest_tensor_histogram_included
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <type_traits>
+#include <vector>
+#include "algotest_tensor.h"
+
+namespace algotest
+{
+    template<class C>
+    struct histogram_result
+    {
+        tensor<C> m_counts;     ///< counts (or sums of weights) of bins
+        tensor<double> m_edges; ///< bins+1 edges, the last bin includes its right edge
+    };
+
+    /**
+     @brief tensor_histogram counts values (or sums their weights) in bins.
+     The tensor is split between threads along its outermost axis in memory order, every thread
+     counts into its own private bins, so there are no races or atomics, and private bins are merged
+     in parallel by ranges of bins. Values are read along the innermost axis in blocks: bin indices
+     of a block are computed first by a branchless loop, then added to the bins.
+     */
+    class tensor_histogram : public tensor_settings
+    {
+    public:
+        enum { KBlock = 256, KMinParallelHistogram = 1<<15 };
+
+        /** @brief sums weights (or counts values if weights is null) into num_bins bins.
+         binBlock(src, stride, n, bins) writes bin indices of n values, -1 for values outside all bins.
+        */
+        template<class C, class T, class W, class BIN_BLOCK>
+        static tensor<C> accumulate(const vtensor<T>& t, const vtensor<W> * weights, index_type num_bins, BIN_BLOCK&& binBlock)
+        {
+            ASSERT(t.ndim()>0 && num_bins>0);
+            ASSERT(!weights || weights->shape.copyShape() == t.shape.copyShape());
+
+            int inner = 0, outer = 0;
+            for(int i=1; i<t.ndim(); ++i)
+            {
+                if (std::abs(t.stride(i)) < std::abs(t.stride(inner))) inner = i;
+                if (std::abs(t.stride(i)) > std::abs(t.stride(outer))) outer = i;
+            }
+            index_type ts = t.stride(inner), ws = weights ? weights->stride(inner) : 0;
+
+            // private bins should not take more memory than the input
+            int num_threads = t.numElements() < KMinParallelHistogram ? 1 : sysutils::getOptimalParallelThreads();
+            num_threads = std::max(1, std::min<int>({ num_threads, t.shape[outer], t.numElements()/num_bins }));
+
+            std::vector< std::vector<C> > partials( size_t(num_threads), std::vector<C>( size_t(num_bins), C(0) ) );
+            sysutils::runForThreads(num_threads, 0, num_threads, [&](int beg, int end)
+                {
+                    index_type bins[KBlock];
+                    for(int p=beg; p<end; ++p)
+                    {
+                        C * h = partials[p].data();
+                        index_type b = index_type( int64_t(t.shape[outer])*p/num_threads );
+                        index_type e = index_type( int64_t(t.shape[outer])*(p+1)/num_threads );
+                        const vtensor<T> part = t.cropAxis(outer, b, e);
+                        const vtensor<T> lines = part.destroyAxis(inner);
+                        index_type n = part.shape[inner];
+
+                        auto line = [&](const T * src, const W * w)
+                        {
+                            for(index_type j=0; j<n; j+=KBlock)
+                            {
+                                index_type m = std::min<index_type>(KBlock, n-j);
+                                binBlock(src + j*ts, ts, m, bins);
+                                if (w) { for(index_type i=0; i<m; ++i) if (bins[i]>=0) h[bins[i]] += C( w[(j+i)*ws] ); }
+                                else   { for(index_type i=0; i<m; ++i) if (bins[i]>=0) h[bins[i]] += C(1); }
+                            }
+                        };
+                        if (weights) lines.apply( weights->cropAxis(outer, b, e).destroyAxis(inner),
+                                                  [&line](const T& src, const W& w) { line(&src, &w); } );
+                        else lines.apply( [&line](const T& src) { line(&src, nullptr); } );
+                    }
+                });
+
+            tensor<C> res( tensor_shape{num_bins} );
+            C * dst = res.data();
+            sysutils::runForThreads(sysutils::KNumThreadsAuto, 0, num_bins, [&](int beg, int end)
+                {
+                    for(index_type b=beg; b<end; ++b)
+                    {
+                        C sum = 0;
+                        for(const std::vector<C>& h : partials) sum += h[b];
+                        dst[b] = sum;
+                    }
+                });
+            return res;
+        }
+
+        /// bin indices of uniform bins over [lo, hi], vectorizable (no branches)
+        template<class T>
+        static auto uniformBins(index_type num_bins, double lo, double hi)
+        {
+            double scale = num_bins/(hi-lo);
+            return [num_bins, lo, hi, scale](const T * src, index_type stride, index_type n, index_type * bins)
+            {
+                for(index_type i=0; i<n; ++i)
+                {
+                    double v = double( src[i*stride] );
+                    bool inside = v>=lo && v<=hi;
+                    index_type b = index_type( inside ? (v-lo)*scale : 0.0 );
+                    bins[i] = inside ? std::min(b, num_bins-1) : -1;
+                }
+            };
+        }
+
+        /// [lo, hi] of values if the range is empty (widened by 0.5 if all values are equal)
+        template<class T>
+        static void defaultRange(const vtensor<T>& t, double& lo, double& hi)
+        {
+            if (lo<hi) return;
+            lo = double( t.min(std::vector<int>()).item() );
+            hi = double( t.max(std::vector<int>()).item() );
+            if (lo==hi) { lo -= 0.5; hi += 0.5; }
+        }
+
+        template<class C, class T, class W>
+        static histogram_result<C> histogram(const vtensor<T>& t, const vtensor<W> * weights, index_type bins, double lo, double hi)
+        {
+            ASSERT(bins>0);
+            defaultRange(t, lo, hi);
+            return histogram_result<C> { accumulate<C>(t, weights, bins, uniformBins<T>(bins, lo, hi)),
+                                         tensor<double>::linspace(lo, hi, bins+1) };
+        }
+
+        template<class C, class T, class W>
+        static tensor<C> bincount(const vtensor<T>& t, const vtensor<W> * weights, index_type minlength)
+        {
+            static_assert(std::is_integral_v<T>, "bincount requires integer values");
+            ASSERT(t.numElements()==0 || t.min(std::vector<int>()).item() >= 0);
+            index_type num_bins = minlength;
+            if (t.numElements()>0) num_bins = std::max( num_bins, index_type( t.max(std::vector<int>()).item() ) + 1 );
+            if (num_bins==0) return tensor<C>( tensor_shape{0} );
+            return accumulate<C>(t, weights, num_bins, [](const T * src, index_type stride, index_type n, index_type * bins)
+                {
+                    for(index_type i=0; i<n; ++i) bins[i] = index_type( src[i*stride] );
+                });
+        }
+    };
+
+    /** @brief counts of values in uniform bins over [lo, hi] (the range of values if lo>=hi).
+     Values outside the range are not counted, the last bin includes hi.
+    */
+    template<class T>
+    histogram_result<tensor_settings::index_type> histogram(const vtensor<T>& t, tensor_settings::index_type bins = 10,
+                                                            double lo = 0, double hi = 0)
+    {
+        return tensor_histogram::histogram<tensor_settings::index_type, T, T>(t, nullptr, bins, lo, hi);
+    }
+
+    /// sums of weights of values in bins, weights have the shape of t
+    template<class T, class W>
+    histogram_result<W> histogram(const vtensor<T>& t, const vtensor<W>& weights, tensor_settings::index_type bins = 10,
+                                  double lo = 0, double hi = 0)
+    {
+        return tensor_histogram::histogram<W>(t, &weights, bins, lo, hi);
+    }
+
+    /// number of occurrences of every non-negative integer value, at least minlength bins
+    template<class T>
+    tensor<tensor_settings::index_type> bincount(const vtensor<T>& t, tensor_settings::index_type minlength = 0)
+    {
+        return tensor_histogram::bincount<tensor_settings::index_type, T, T>(t, nullptr, minlength);
+    }
+
+    /// sums of weights of every non-negative integer value, weights have the shape of t
+    template<class T, class W>
+    tensor<W> bincount(const vtensor<T>& t, const vtensor<W>& weights, tensor_settings::index_type minlength = 0)
+    {
+        return tensor_histogram::bincount<W>(t, &weights, minlength);
+    }
+}
+
+#endif // algotest_tensor_histogram_included
@@ -0,0 +1,860 @@
+/*  The Mathutil library
+ Copyright (C) 2007-2022 Maksym Davydov
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; version 3
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef algotest_tensor_linalg_included
+#define algotest_tensor_linalg_included
+
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include "algotest_tensor.h"
+
+namespace algotest
+{
+    /// LU decomposition with partial pivoting P*A = L*U.
+    /// L (unit diagonal is not stored) and U share one matrix.
+    template<class T>
+    struct lu_decomposition
+    {
+        tensor<T> m_lu;
+        std::vector<tensor_settings::index_type> m_pivots;  // row i was swapped with row m_pivots[i]
+        int m_sign = 1;                                     // sign of the permutation P
+        bool m_singular = false;
+    };
+
+    /**
+     @brief tensor_linalg implements dense factorizations on strided matrices (see tensor_gemm::matrix_ref).
+     Factorizations are blocked: panels are factorized serially, the trailing matrix is updated
+     with tensor_gemm in parallel threads.
+     */
+    class tensor_linalg : public tensor_settings
+    {
+    public:
+        enum { KBlockSize = 64, KMinParallelWork = tensor_gemm::KMinParallelWork };
+
+        template<class T> using matrix_ref = tensor_gemm::matrix_ref<T>;
+
+        template<class T>
+        static matrix_ref<T> sub(const matrix_ref<T>& a, index_type row, index_type col)
+        {
+            return a.displaced(row*a.m_rs + col*a.m_cs);
+        }
+
+        /// swaps rows i and pivots[i] for i in [begin, end) in columns [col_begin, col_end)
+        template<class T>
+        static void swapRows(const matrix_ref<T>& a, const std::vector<index_type>& pivots,
+                             index_type begin, index_type end, index_type col_begin, index_type col_end)
+        {
+            for(index_type i=begin; i<end; ++i)
+            {
+                index_type p = pivots[i];
+                if (p==i) continue;
+                for(index_type j=col_begin; j<col_end; ++j) std::swap(a(i,j), a(p,j));
+            }
+        }
+
+        /// LU of the m x n panel (m>=n) with partial pivoting, pivots are relative to the panel.
+        /// Returns false if a pivot is zero, elimination continues with the next column.
+        template<class T>
+        static bool factorizePanel(const matrix_ref<T>& a, index_type m, index_type n, index_type * pivots)
+        {
+            bool nonsingular = true;
+            for(index_type j=0; j<n; ++j)
+            {
+                index_type p = j;
+                for(index_type i=j+1; i<m; ++i)
+                {
+                    if (std::abs(a(i,j)) > std::abs(a(p,j))) p = i;
+                }
+                pivots[j] = p;
+                if (a(p,j)==T(0)) { nonsingular = false; continue; }
+                if (p!=j) for(index_type c=0; c<n; ++c) std::swap(a(j,c), a(p,c));
+
+                T inv = T(1)/a(j,j);
+                for(index_type i=j+1; i<m; ++i)
+                {
+                    T l = a(i,j) *= inv;
+                    for(index_type c=j+1; c<n; ++c) a(i,c) -= l*a(j,c);
+                }
+            }
+            return nonsingular;
+        }
+
+        /// blocked LU of the n x n matrix in place, returns false if the matrix is singular
+        template<class T>
+        static bool factorizeLU(const matrix_ref<T>& a, index_type n, std::vector<index_type>& pivots,
+                                int num_threads = sysutils::KNumThreadsAuto)
+        {
+            pivots.resize(size_t(n));
+            bool nonsingular = true;
+            for(index_type j=0; j<n; j+=KBlockSize)
+            {
+                index_type jb = std::min<index_type>(KBlockSize, n-j);
+                nonsingular = factorizePanel(sub(a, j, j), n-j, jb, pivots.data()+j) && nonsingular;
+                for(index_type i=j; i<j+jb; ++i) pivots[i] += j;
+
+                swapRows(a, pivots, j, j+jb, 0, j);
+                swapRows(a, pivots, j, j+jb, j+jb, n);
+
+                index_type rest = n-j-jb;
+                if (rest>0)
+                {
+                    // U12 = L11^-1 * A12, A22 -= L21 * U12
+                    solveLower(sub(a, j, j), jb, true, sub(a, j, j+jb), rest, num_threads);
+                    tensor_gemm::multiply(rest, rest, jb, sub(a, j+jb, j), sub(a, j, j+jb), sub(a, j+jb, j+jb),
+                                          KGemmSubtract, num_threads);
+                }
+            }
+            return nonsingular;
+        }
+
+        /// unblocked Cholesky factorization A = L*L^T of the lower triangle, returns false if A is not positive definite
+        template<class T>
+        static bool factorizeCholeskyBlock(const matrix_ref<T>& a, index_type n)
+        {
+            for(index_type j=0; j<n; ++j)
+            {
+                T d = a(j,j);
+                for(index_type k=0; k<j; ++k) d -= a(j,k)*a(j,k);
+                if (!(d>T(0))) return false;
+                d = std::sqrt(d);
+                a(j,j) = d;
+                
+                T inv = T(1)/d;
+                for(index_type i=j+1; i<n; ++i)
+                {
+                    T v = a(i,j);
+                    for(index_type k=0; k<j; ++k) v -= a(i,k)*a(j,k);
+                    a(i,j) = v*inv;
+                }
+            }
+            return true;
+        }
+
+        /** @brief blocked Cholesky factorization A = L*L^T in place.
+         Only the lower triangle of A is read, on success it is replaced by L and the upper triangle is zeroed.
+         Returns false if A is not positive definite.
+        */
+        template<class T>
+        static bool factorizeCholesky(const matrix_ref<T>& a, index_type n, int num_threads = sysutils::KNumThreadsAuto)
+        {
+            for(index_type j=0; j<n; j+=KBlockSize)
+            {
+                index_type jb = std::min<index_type>(KBlockSize, n-j);
+                if (!factorizeCholeskyBlock(sub(a, j, j), jb)) return false;
+
+                index_type rest = n-j-jb;
+                if (rest>0)
+                {
+                    // L21 = A21 * L11^-T, i.e. L21^T = L11^-1 * A21^T
+                    solveLower(sub(a, j, j), jb, false, sub(a, j+jb, j).transposed(), rest, num_threads);
+
+                    // A22 -= L21 * L21^T, only block columns of the lower triangle
+                    for(index_type jj=j+jb; jj<n; jj+=KBlockSize)
+                    {
+                        index_type w = std::min<index_type>(KBlockSize, n-jj);
+                        tensor_gemm::multiply(n-jj, w, jb, sub(a, jj, j), sub(a, jj, j).transposed(), sub(a, jj, jj),
+                                              KGemmSubtract, num_threads);
+                    }
+                }
+            }
+
+            for(index_type i=0; i<n; ++i) for(index_type j=i+1; j<n; ++j) a(i,j) = T(0);
+            return true;
+        }
+
+        /// B = L^-1 * B for lower triangular n x n matrix L and n x nrhs matrix B.
+        /// Blocks of rows are updated with tensor_gemm, columns of B are solved in parallel.
+        template<class T>
+        static void solveLower(const matrix_ref<T>& l, index_type n, bool unit_diagonal,
+                               const matrix_ref<T>& b, index_type nrhs, int num_threads = sysutils::KNumThreadsAuto)
+        {
+            for(index_type i=0; i<n; i+=KBlockSize)
+            {
+                index_type ib = std::min<index_type>(KBlockSize, n-i);
+                if (i>0) tensor_gemm::multiply(ib, nrhs, i, sub(l, i, 0), b, sub(b, i, 0), KGemmSubtract, num_threads);
+                solveLowerBlock(sub(l, i, i), ib, unit_diagonal, sub(b, i, 0), nrhs, num_threads);
+            }
+        }
+
+        /// B = U^-1 * B for upper triangular n x n matrix U (use transposed() of L to solve with L^T)
+        template<class T>
+        static void solveUpper(const matrix_ref<T>& u, index_type n, bool unit_diagonal,
+                               const matrix_ref<T>& b, index_type nrhs, int num_threads = sysutils::KNumThreadsAuto)
+        {
+            for(index_type end=n; end>0; )
+            {
+                index_type i = std::max<index_type>(0, end-KBlockSize);
+                if (end<n) tensor_gemm::multiply(end-i, nrhs, n-end, sub(u, i, end), sub(b, end, 0), sub(b, i, 0),
+                                                 KGemmSubtract, num_threads);
+                solveUpperBlock(sub(u, i, i), end-i, unit_diagonal, sub(b, i, 0), nrhs, num_threads);
+                end = i;
+            }
+        }
+
+        /// makes Householder reflector H = I - tau*v*v^T (v(0)=1) that maps x of n elements to (beta, 0, ..., 0).
+        /// x(0) is replaced by beta, the rest of x by v, returns tau (0 if x is already in the form).
+        template<class T>
+        static T makeReflector(T * x, index_type n, index_type stride)
+        {
+            T alpha = x[0];
+            T xnorm2 = T(0);
+            for(index_type i=1; i<n; ++i) xnorm2 += x[i*stride]*x[i*stride];
+            if (xnorm2==T(0)) return T(0);
+            
+            T beta = std::sqrt(alpha*alpha + xnorm2);
+            if (alpha>T(0)) beta = -beta;
+            T scale = T(1)/(alpha-beta);
+            for(index_type i=1; i<n; ++i) x[i*stride] *= scale;
+            x[0] = beta;
+            return (beta-alpha)/beta;
+        }
+
+        /// unblocked Householder QR of the m x n panel, R replaces the upper triangle, reflectors are stored below
+        template<class T>
+        static void factorizeQRPanel(const matrix_ref<T>& a, index_type m, index_type n, T * tau)
+        {
+            for(index_type j=0, k=std::min(m,n); j<k; ++j)
+            {
+                T tj = tau[j] = makeReflector(&a(j,j), m-j, a.m_rs);
+                if (tj==T(0)) continue;
+                for(index_type c=j+1; c<n; ++c)
+                {
+                    T w = a(j,c);
+                    for(index_type i=j+1; i<m; ++i) w += a(i,j)*a(i,c);
+                    w *= tj;
+                    a(j,c) -= w;
+                    for(index_type i=j+1; i<m; ++i) a(i,c) -= a(i,j)*w;
+                }
+            }
+        }
+
+        /** @brief C = Q^T*C (transpose) or C = Q*C for Q = H(0)*...*H(k-1) given by k reflectors
+         stored below the diagonal of the m x k matrix v (as factorizeQRPanel leaves them).
+         The reflectors are applied at once in the compact WY form Q = I - V*T*V^T with tensor_gemm.
+        */
+        template<class T>
+        static void applyReflectors(const matrix_ref<T>& v, index_type m, index_type k, const T * tau,
+                                    const matrix_ref<T>& c, index_type nc, bool transpose,
+                                    int num_threads = sysutils::KNumThreadsAuto)
+        {
+            if (k==0 || nc==0) return;
+            
+            // explicit V with the unit diagonal
+            std::vector<T> vbuf( size_t(m)*k, T(0) );
+            matrix_ref<T> ve { vbuf.data(), k, 1 };
+            for(index_type i=0; i<m; ++i)
+            {
+                for(index_type j=0; j<k && j<=i; ++j) ve(i,j) = i==j ? T(1) : v(i,j);
+            }
+            
+            // T is upper triangular: T(i,i) = tau(i), T(0:i,i) = -tau(i) * T(0:i,0:i) * V(:,0:i)^T * v(i)
+            std::vector<T> gbuf( size_t(k)*k ), tbuf( size_t(k)*k, T(0) );
+            matrix_ref<T> g { gbuf.data(), k, 1 }, t { tbuf.data(), k, 1 };
+            tensor_gemm::multiply(k, k, m, ve.transposed(), ve, g, KGemmSet, num_threads);
+            for(index_type i=0; i<k; ++i)
+            {
+                t(i,i) = tau[i];
+                for(index_type j=0; j<i; ++j)
+                {
+                    T sum = T(0);
+                    for(index_type l=j; l<i; ++l) sum += t(j,l)*g(l,i);
+                    t(j,i) = -tau[i]*sum;
+                }
+            }
+            
+            // C -= V * op(T) * (V^T * C), op(T) = T^T for Q^T
+            std::vector<T> wbuf( size_t(k)*nc ), w2buf( size_t(k)*nc );
+            matrix_ref<T> w { wbuf.data(), nc, 1 }, w2 { w2buf.data(), nc, 1 };
+            tensor_gemm::multiply(k, nc, m, ve.transposed(), c, w, KGemmSet, num_threads);
+            tensor_gemm::multiply(k, nc, k, transpose ? t.transposed() : t, w, w2, KGemmSet, num_threads);
+            tensor_gemm::multiply(m, nc, k, ve, w2, c, KGemmSubtract, num_threads);
+        }
+
+        /// blocked Householder QR of the m x n matrix in place, tau should have min(m,n) elements
+        template<class T>
+        static void factorizeQR(const matrix_ref<T>& a, index_type m, index_type n, T * tau,
+                                int num_threads = sysutils::KNumThreadsAuto)
+        {
+            for(index_type j=0, k=std::min(m,n); j<k; j+=KBlockSize)
+            {
+                index_type jb = std::min<index_type>(KBlockSize, k-j);
+                factorizeQRPanel(sub(a, j, j), m-j, jb, tau+j);
+                if (j+jb<n) applyReflectors(sub(a, j, j), m-j, jb, tau+j, sub(a, j, j+jb), n-j-jb, true, num_threads);
+            }
+        }
+
+        /// C = Q^T*C or C = Q*C for Q of factorizeQR (k reflectors of the m x k matrix a), C is m x nc
+        template<class T>
+        static void applyQ(const matrix_ref<T>& a, index_type m, index_type k, const T * tau,
+                           const matrix_ref<T>& c, index_type nc, bool transpose,
+                           int num_threads = sysutils::KNumThreadsAuto)
+        {
+            index_type num_blocks = (k + KBlockSize - 1)/KBlockSize;
+            for(index_type b=0; b<num_blocks; ++b)
+            {
+                // Q^T = H(k-1)...H(0) applies blocks forward, Q backward
+                index_type j = (transpose ? b : num_blocks-1-b)*KBlockSize;
+                index_type jb = std::min<index_type>(KBlockSize, k-j);
+                applyReflectors(sub(a, j, j), m-j, jb, tau+j, sub(c, j, 0), nc, transpose, num_threads);
+            }
+        }
+
+        /** @brief R factor and Q^T*B of a tall-skinny m x n matrix (m >= n) by TSQR.
+         Row blocks are factorized in parallel, their R factors are stacked and factorized again.
+         On return the first n rows of a hold R (upper triangle) and the first n rows of b hold (Q^T*B)(0:n).
+        */
+        template<class T>
+        static void factorizeTSQR(const matrix_ref<T>& a, index_type m, index_type n,
+                                  const matrix_ref<T>& b, index_type nrhs, int num_blocks)
+        {
+            std::vector<T> tau( size_t(num_blocks)*n );
+            index_type rows = m/num_blocks;
+            sysutils::runForThreads(num_blocks, 0, num_blocks, [&](int beg, int end)
+                {
+                    for(int i=beg; i<end; ++i)
+                    {
+                        index_type r0 = i*rows, ri = i==num_blocks-1 ? m-r0 : rows;
+                        factorizeQR(sub(a, r0, 0), ri, n, tau.data() + i*n, 1);
+                        applyQ(sub(a, r0, 0), ri, n, tau.data() + i*n, sub(b, r0, 0), nrhs, true, 1);
+                    }
+                });
+            
+            // stack R factors and the corresponding rows of Q^T*B
+            index_type ms = index_type(num_blocks)*n;
+            std::vector<T> sbuf( size_t(ms)*n, T(0) ), sbbuf( size_t(ms)*nrhs );
+            matrix_ref<T> s { sbuf.data(), n, 1 }, sb { sbbuf.data(), nrhs, 1 };
+            for(int i=0; i<num_blocks; ++i)
+            {
+                for(index_type r=0; r<n; ++r)
+                {
+                    for(index_type c=r; c<n; ++c) s(i*n + r, c) = a(i*rows + r, c);
+                    for(index_type c=0; c<nrhs; ++c) sb(i*n + r, c) = b(i*rows + r, c);
+                }
+            }
+            
+            std::vector<T> stau( static_cast<size_t>(n) );
+            factorizeQR(s, ms, n, stau.data());
+            applyQ(s, ms, n, stau.data(), sb, nrhs, true);
+            
+            for(index_type r=0; r<n; ++r)
+            {
+                for(index_type c=0; c<n; ++c) a(r,c) = c>=r ? s(r,c) : T(0);
+                for(index_type c=0; c<nrhs; ++c) b(r,c) = sb(r,c);
+            }
+        }
+
+        /// unblocked solveLower
+        template<class T>
+        static void solveLowerBlock(const matrix_ref<T>& l, index_type n, bool unit_diagonal,
+                                    const matrix_ref<T>& b, index_type nrhs, int num_threads = sysutils::KNumThreadsAuto)
+        {
+            if (double(n)*n*nrhs < double(KMinParallelWork)) num_threads = 1;
+            sysutils::runForThreads(num_threads, 0, nrhs, [&](int beg, int end)
+                {
+                    for(index_type i=0; i<n; ++i)
+                    {
+                        for(index_type k=0; k<i; ++k)
+                        {
+                            T lik = l(i,k);
+                            for(index_type c=beg; c<end; ++c) b(i,c) -= lik*b(k,c);
+                        }
+                        if (!unit_diagonal)
+                        {
+                            T inv = T(1)/l(i,i);
+                            for(index_type c=beg; c<end; ++c) b(i,c) *= inv;
+                        }
+                    }
+                });
+        }
+
+        /// unblocked solveUpper
+        template<class T>
+        static void solveUpperBlock(const matrix_ref<T>& u, index_type n, bool unit_diagonal,
+                                    const matrix_ref<T>& b, index_type nrhs, int num_threads = sysutils::KNumThreadsAuto)
+        {
+            if (double(n)*n*nrhs < double(KMinParallelWork)) num_threads = 1;
+            sysutils::runForThreads(num_threads, 0, nrhs, [&](int beg, int end)
+                {
+                    for(index_type i=n-1; i>=0; --i)
+                    {
+                        for(index_type k=i+1; k<n; ++k)
+                        {
+                            T uik = u(i,k);
+                            for(index_type c=beg; c<end; ++c) b(i,c) -= uik*b(k,c);
+                        }
+                        if (!unit_diagonal)
+                        {
+                            T inv = T(1)/u(i,i);
+                            for(index_type c=beg; c<end; ++c) b(i,c) *= inv;
+                        }
+                    }
+                });
+        }
+
+        /** @brief calls op(i, num_threads) for every matrix i of the batch of count matrices.
+         Large batches are split between threads with single-threaded kernels,
+         matrices of a small batch get all threads one by one.
+        */
+        template<class OP>
+        static void forEachMatrix(index_type count, OP&& op)
+        {
+            if (count < sysutils::getOptimalParallelThreads())
+            {
+                for(index_type i=0; i<count; ++i) op(i, int(sysutils::KNumThreadsAuto));
+                return;
+            }
+            sysutils::runForThreads(sysutils::KNumThreadsAuto, 0, count, [&op](int beg, int end)
+                {
+                    for(int i=beg; i<end; ++i) op(i, 1);
+                });
+        }
+
+        /// the matrix number i of a batch over the leading axes of a
+        template<class T>
+        static matrix_ref<T> batchMatrix(const vtensor<T>& a, index_type i)
+        {
+            index_type disp = 0;
+            for(int axis=a.ndim()-3; axis>=0; --axis)
+            {
+                disp += (i % a.shape[axis])*a.stride(axis);
+                i /= a.shape[axis];
+            }
+            return std::as_const(a).matrixRef().displaced(disp);
+        }
+
+        template<class T>
+        static index_type batchSize(const vtensor<T>& a)
+        {
+            ASSERT(a.ndim()>=2);
+            index_type res = 1;
+            for(int axis=0; axis<a.ndim()-2; ++axis) res *= a.shape[axis];
+            return res;
+        }
+    };
+
+    /** @brief Cholesky factorization A = L*L^T of symmetric positive definite matrices in place.
+     a is a matrix or a batch of matrices over the leading axes, it may be any strided view.
+     Only the lower triangle is read, it is replaced by L and the upper triangle is zeroed.
+     Returns false if any matrix is not positive definite (its values are undefined then).
+    */
+    template<class T>
+    bool cholesky_inplace(vtensor<T> a)
+    {
+        ASSERT(a.ndim()>=2 && a.shape[a.ndim()-1]==a.shape[a.ndim()-2]);
+        tensor_settings::index_type n = a.shape[a.ndim()-1];
+        a.matrixRef(); // copy-on-write tensor gets private data
+        
+        std::atomic<bool> ok { true };
+        tensor_linalg::forEachMatrix( tensor_linalg::batchSize(a), [&](tensor_settings::index_type i, int num_threads)
+            {
+                if (!tensor_linalg::factorizeCholesky(tensor_linalg::batchMatrix(a, i), n, num_threads)) ok = false;
+            });
+        return ok;
+    }
+
+    /// lower triangular L with A = L*L^T for symmetric positive definite A (or a batch of them)
+    template<class T>
+    tensor<T> cholesky(const vtensor<T>& a)
+    {
+        tensor<T> res = a.deepCopy();
+        bool positive_definite = cholesky_inplace(res);
+        ASSERT(positive_definite);
+        return res;
+    }
+
+    /** @brief solves T*X = B in place of b for triangular matrices T.
+     t is a matrix or a batch of matrices, b is a batch of n x nrhs matrices over the same leading axes
+     (a single matrix t is used for all matrices of b). Both may be any strided views.
+     transpose solves T^T*X = B, so a Cholesky factor L serves both passes without a copy.
+    */
+    template<class T>
+    void solve_triangular_inplace(const vtensor<T>& t, vtensor<T> b, bool lower,
+                                  bool transpose = false, bool unit_diagonal = false)
+    {
+        ASSERT(t.ndim()>=2 && b.ndim()>=2);
+        tensor_settings::index_type n = t.shape[t.ndim()-1], nrhs = b.shape[b.ndim()-1];
+        ASSERT(t.shape[t.ndim()-2]==n && b.shape[b.ndim()-2]==n);
+        ASSERT(t.ndim()==2 || (t.ndim()==b.ndim() && tensor_linalg::batchSize(t)==tensor_linalg::batchSize(b)));
+        b.matrixRef(); // copy-on-write tensor gets private data
+        
+        tensor_linalg::forEachMatrix( tensor_linalg::batchSize(b), [&](tensor_settings::index_type i, int num_threads)
+            {
+                auto tr = t.ndim()==2 ? t.matrixRef() : tensor_linalg::batchMatrix(t, i);
+                if (transpose) tr = tr.transposed();
+                auto br = tensor_linalg::batchMatrix(b, i);
+                if (lower!=transpose) tensor_linalg::solveLower(tr, n, unit_diagonal, br, nrhs, num_threads);
+                else tensor_linalg::solveUpper(tr, n, unit_diagonal, br, nrhs, num_threads);
+            });
+    }
+
+    /// solves T*X = B for triangular T, b is a vector or a (batch of) matrices of right-hand sides
+    template<class T>
+    tensor<T> solve_triangular(const vtensor<T>& t, const vtensor<T>& b, bool lower,
+                               bool transpose = false, bool unit_diagonal = false)
+    {
+        tensor<T> x = b.deepCopy();
+        solve_triangular_inplace(t, b.ndim()==1 ? x.insertAxis(1, 1) : x, lower, transpose, unit_diagonal);
+        return x;
+    }
+
+    /// solves A*X = B for A = L*L^T given its Cholesky factor L
+    template<class T>
+    tensor<T> cholesky_solve(const vtensor<T>& l, const vtensor<T>& b)
+    {
+        tensor<T> x = b.deepCopy();
+        tensor<T> x2 = b.ndim()==1 ? x.insertAxis(1, 1) : x;
+        solve_triangular_inplace(l, x2, true);
+        solve_triangular_inplace(l, x2, true, true);
+        return x;
+    }
+
+    /// Householder QR decomposition A = Q*R, R is in the upper triangle of m_qr, reflectors of Q are below it
+    template<class T>
+    struct qr_decomposition
+    {
+        tensor<T> m_qr;
+        std::vector<T> m_tau;
+    };
+
+    /// blocked Householder QR of the m x n matrix a
+    template<class T>
+    qr_decomposition<T> qr(const vtensor<T>& a)
+    {
+        ASSERT(a.ndim()==2);
+        qr_decomposition<T> res;
+        res.m_qr = a.deepCopy();
+        res.m_tau.resize( size_t( std::min(a.shape[0], a.shape[1]) ) );
+        tensor_linalg::factorizeQR(res.m_qr.matrixRef(), a.shape[0], a.shape[1], res.m_tau.data());
+        return res;
+    }
+
+    /// upper triangular k x n factor R, k = min(m,n)
+    template<class T>
+    tensor<T> qr_r(const qr_decomposition<T>& d)
+    {
+        tensor_settings::index_type k = tensor_settings::index_type(d.m_tau.size()), n = d.m_qr.shape[1];
+        tensor<T> r = d.m_qr.crop({0,0}, {k,n}).deepCopy();
+        for(tensor_settings::index_type i=1; i<k; ++i)
+        {
+            for(tensor_settings::index_type j=0; j<std::min(i,n); ++j) r[{i,j}] = T(0);
+        }
+        return r;
+    }
+
+    /// m x k factor Q with orthonormal columns, k = min(m,n)
+    template<class T>
+    tensor<T> qr_q(const qr_decomposition<T>& d)
+    {
+        tensor_settings::index_type m = d.m_qr.shape[0], k = tensor_settings::index_type(d.m_tau.size());
+        tensor<T> q = vtensor<T>::zeros({m,k});
+        for(tensor_settings::index_type i=0; i<k; ++i) q[{i,i}] = T(1);
+        tensor_linalg::applyQ(std::as_const(d.m_qr).matrixRef(), m, k, d.m_tau.data(), q.matrixRef(), k, false);
+        return q;
+    }
+
+    /** @brief least squares solution of A*X = B for the m x n matrix A of full rank, m >= n.
+     b is a vector or a matrix of right-hand sides. Tall-skinny matrices are factorized by TSQR
+     (row blocks in parallel), others by the blocked Householder QR.
+    */
+    template<class T>
+    tensor<T> lstsq(const vtensor<T>& a, const vtensor<T>& b)
+    {
+        ASSERT(a.ndim()==2 && (b.ndim()==1 || b.ndim()==2));
+        tensor_settings::index_type m = a.shape[0], n = a.shape[1];
+        ASSERT(m>=n && b.shape[0]==m);
+        
+        tensor<T> ac = a.deepCopy();
+        tensor<T> bc = b.deepCopy();
+        tensor<T> bc2 = b.ndim()==1 ? bc.insertAxis(1, 1) : bc;
+        tensor_settings::index_type nrhs = bc2.shape[1];
+        auto ar = ac.matrixRef();
+        auto br = bc2.matrixRef();
+        
+        // every row block of TSQR should be much taller than wide
+        int num_blocks = std::min<int>( sysutils::getOptimalParallelThreads(), int(m/(4*std::max(n, 1))) );
+        if (num_blocks>=2 && n>0)
+        {
+            tensor_linalg::factorizeTSQR(ar, m, n, br, nrhs, num_blocks);
+        }
+        else
+        {
+            std::vector<T> tau( static_cast<size_t>(n) );
+            tensor_linalg::factorizeQR(ar, m, n, tau.data());
+            tensor_linalg::applyQ(ar, m, n, tau.data(), br, nrhs, true);
+        }
+        
+        tensor_linalg::solveUpper(ar, n, false, br, nrhs);
+        return bc.cropAxis(0, 0, n).deepCopy();
+    }
+
+    /// thin singular value decomposition A = U*diag(S)*Vt, singular values are sorted in descending order
+    template<class T>
+    struct svd_decomposition
+    {
+        tensor<T> m_u;  // m x k
+        tensor<T> m_s;  // k
+        tensor<T> m_vt; // k x n
+    };
+
+    /** @brief thin SVD of the m x n matrix by one-sided Jacobi rotations, k = min(m,n).
+     It is accurate for small matrices, use randomized_svd for top components of large ones.
+    */
+    template<class T>
+    svd_decomposition<T> svd(const vtensor<T>& a)
+    {
+        typedef tensor_settings::index_type index_type;
+        ASSERT(a.ndim()==2);
+        if (a.shape[0] < a.shape[1])
+        {
+            svd_decomposition<T> t = svd(a.transpose());
+            return svd_decomposition<T>{ t.m_vt.transpose().deepCopy(), t.m_s, t.m_u.transpose().deepCopy() };
+        }
+        
+        index_type m = a.shape[0], n = a.shape[1];
+        // rows of w are columns of A, rotations make them orthogonal: A*V = W^T
+        tensor<T> w = a.transpose().deepCopy();
+        tensor<T> v = vtensor<T>::identity(n);
+        T * pw = w.data();
+        T * pv = v.data();
+        
+        const T eps = std::numeric_limits<T>::epsilon();
+        for(int sweep=0; sweep<60; ++sweep)
+        {
+            bool rotated = false;
+            for(index_type p=0; p<n; ++p)
+            {
+                for(index_type q=p+1; q<n; ++q)
+                {
+                    T * wp = pw + p*m, * wq = pw + q*m;
+                    T alpha = T(0), beta = T(0), gamma = T(0);
+                    for(index_type i=0; i<m; ++i)
+                    {
+                        alpha += wp[i]*wp[i];
+                        beta += wq[i]*wq[i];
+                        gamma += wp[i]*wq[i];
+                    }
+                    if (std::abs(gamma) <= eps*std::sqrt(alpha*beta)) continue;
+                    rotated = true;
+                    
+                    T zeta = (beta-alpha)/(2*gamma);
+                    T t = (zeta>=T(0) ? T(1) : T(-1))/(std::abs(zeta) + std::sqrt(T(1) + zeta*zeta));
+                    T c = T(1)/std::sqrt(T(1) + t*t), s = c*t;
+                    for(index_type i=0; i<m; ++i)
+                    {
+                        T x = wp[i], y = wq[i];
+                        wp[i] = c*x - s*y;
+                        wq[i] = s*x + c*y;
+                    }
+                    for(index_type i=0; i<n; ++i)
+                    {
+                        T& x = pv[i*n + p];
+                        T& y = pv[i*n + q];
+                        T vx = x, vy = y;
+                        x = c*vx - s*vy;
+                        y = s*vx + c*vy;
+                    }
+                }
+            }
+            if (!rotated) break;
+        }
+        
+        std::vector<T> norms( static_cast<size_t>(n) );
+        std::vector<index_type> order( static_cast<size_t>(n) );
+        for(index_type j=0; j<n; ++j)
+        {
+            T sum = T(0);
+            for(index_type i=0; i<m; ++i) sum += pw[j*m + i]*pw[j*m + i];
+            norms[j] = std::sqrt(sum);
+            order[j] = j;
+        }
+        std::stable_sort(order.begin(), order.end(), [&norms](index_type x, index_type y) { return norms[x] > norms[y]; });
+        
+        svd_decomposition<T> res { tensor<T>( tensor_shape{m,n} ), tensor<T>( tensor_shape{n} ), tensor<T>( tensor_shape{n,n} ) };
+        for(index_type j=0; j<n; ++j)
+        {
+            index_type o = order[j];
+            T sigma = norms[o];
+            res.m_s[{j}] = sigma;
+            for(index_type i=0; i<m; ++i) res.m_u[{i,j}] = sigma>T(0) ? pw[o*m + i]/sigma : T(i==j ? 1 : 0);
+            for(index_type i=0; i<n; ++i) res.m_vt[{j,i}] = pv[i*n + o];
+        }
+        return res;
+    }
+
+    /// orthonormal basis of the columns of the tall m x l matrix
+    template<class T>
+    tensor<T> orthonormalize(const vtensor<T>& y)
+    {
+        return qr_q(qr(y));
+    }
+
+    /** @brief randomized truncated SVD of the m x n operator given by products
+     mul(X) = A*X for n x l matrices X and mul_t(Y) = A^T*Y for m x l matrices Y.
+     The range of A is sampled by a random projection, refined by power iterations
+     with re-orthonormalization, and the small projected matrix is decomposed by svd.
+    */
+    template<class T, class MUL, class MULT>
+    svd_decomposition<T> randomized_svd_operator(tensor_settings::index_type m, tensor_settings::index_type n,
+                                                 tensor_settings::index_type k, MUL&& mul, MULT&& mul_t,
+                                                 int oversampling = 10, int power_iterations = 2)
+    {
+        tensor_settings::index_type l = std::min<tensor_settings::index_type>( k + oversampling, std::min(m, n) );
+        ASSERT(k>0 && k<=l);
+        
+        tensor<T> q = orthonormalize<T>( mul( vtensor<T>::random({n,l}, T(-1), T(1)) ) );
+        for(int i=0; i<power_iterations; ++i)
+        {
+            q = orthonormalize<T>( mul( orthonormalize<T>( mul_t(q) ) ) );
+        }
+        
+        // B = Q^T*A, svd(B^T) = W*S*Z^T gives A ~ (Q*Z)*S*W^T
+        svd_decomposition<T> b = svd( vtensor<T>( mul_t(q) ) );
+        return svd_decomposition<T> { q.matmul( b.m_vt.transpose().cropAxis(1, 0, k) ),
+                                      b.m_s.cropAxis(0, 0, k).deepCopy(),
+                                      b.m_u.cropAxis(1, 0, k).transpose().deepCopy() };
+    }
+
+    /// top k singular triplets of the matrix a (see randomized_svd_operator), products run on tensor_gemm
+    template<class T>
+    svd_decomposition<T> randomized_svd(const vtensor<T>& a, tensor_settings::index_type k,
+                                        int oversampling = 10, int power_iterations = 2)
+    {
+        ASSERT(a.ndim()==2);
+        return randomized_svd_operator<T>( a.shape[0], a.shape[1], k,
+                                           [&a](const vtensor<T>& x) { return a.matmul(x); },
+                                           [&a](const vtensor<T>& y) { return a.transpose().matmul(y); },
+                                           oversampling, power_iterations );
+    }
+
+    template<class T>
+    struct pca_result
+    {
+        tensor<T> m_mean;               // d
+        tensor<T> m_components;         // k x d, principal axes in rows
+        tensor<T> m_explained_variance; // k
+    };
+
+    /** @brief top k principal components of m samples in rows of the m x d matrix x.
+     The mean is found in one pass and products with the centered matrix X - 1*mean^T are corrected
+     by rank-one terms, so the centered copy of x is never made.
+    */
+    template<class T>
+    pca_result<T> pca(const vtensor<T>& x, tensor_settings::index_type k, int oversampling = 10, int power_iterations = 2)
+    {
+        ASSERT(x.ndim()==2 && x.shape[0]>1);
+        tensor_settings::index_type m = x.shape[0], d = x.shape[1];
+        tensor<T> mean = x.sum(0)/T(m);
+        tensor<T> mean_row = mean.insertAxis(0, 1);
+        
+        svd_decomposition<T> s = randomized_svd_operator<T>( m, d, k,
+            [&x, &mean_row](const vtensor<T>& w)
+            {
+                tensor<T> res = x.matmul(w);
+                res -= mean_row.matmul(w);
+                return res;
+            },
+            [&x, &mean_row](const vtensor<T>& y)
+            {
+                tensor<T> res = x.transpose().matmul(y);
+                res -= mean_row.transpose().matmul( y.sum(0).insertAxis(0, 1) );
+                return res;
+            },
+            oversampling, power_iterations );
+        
+        tensor<T> variance = s.m_s*s.m_s/T(m-1);
+        return pca_result<T> { mean, s.m_vt, variance };
+    }
+
+    /// LU decomposition of the square matrix a
+    template<class T>
+    lu_decomposition<T> lu(const vtensor<T>& a)
+    {
+        ASSERT(a.ndim()==2 && a.shape[0]==a.shape[1]);
+        lu_decomposition<T> res;
+        res.m_lu = a.deepCopy();
+        res.m_singular = !tensor_linalg::factorizeLU(res.m_lu.matrixRef(), a.shape[0], res.m_pivots);
+        for(size_t i=0; i<res.m_pivots.size(); ++i)
+        {
+            if (res.m_pivots[i]!=tensor_settings::index_type(i)) res.m_sign = -res.m_sign;
+        }
+        return res;
+    }
+
+    /// solves A*X = B for X using LU decomposition of A, b is a vector or a matrix of right-hand sides.
+    /// Values are not finite if A is singular.
+    template<class T>
+    tensor<T> lu_solve(const lu_decomposition<T>& d, const vtensor<T>& b)
+    {
+        ASSERT(b.ndim()==1 || b.ndim()==2);
+        tensor_settings::index_type n = d.m_lu.shape[0];
+        ASSERT(b.shape[0]==n);
+
+        tensor<T> x = b.deepCopy();
+        tensor<T> x2 = b.ndim()==1 ? x.insertAxis(1, 1) : x;
+        tensor_settings::index_type nrhs = x2.shape[1];
+
+        auto xr = x2.matrixRef();
+        auto lur = std::as_const(d.m_lu).matrixRef();
+        tensor_linalg::swapRows(xr, d.m_pivots, 0, n, 0, nrhs);
+        tensor_linalg::solveLower(lur, n, true, xr, nrhs);
+        tensor_linalg::solveUpper(lur, n, false, xr, nrhs);
+        return x;
+    }
+
+    /// solves A*X = B, b is a vector or a matrix of right-hand sides
+    template<class T>
+    tensor<T> solve(const vtensor<T>& a, const vtensor<T>& b)
+    {
+        return lu_solve(lu(a), b);
+    }
+
+    template<class T>
+    tensor<T> inverse(const vtensor<T>& a)
+    {
+        return lu_solve(lu(a), vtensor<T>::identity(a.shape[0]));
+    }
+
+    /// inverts m into res (res is allocated if it is empty), returns false if m is singular
+    template<class T>
+    bool invert_with_LU_decomposition(tensor<T>& res, const vtensor<T>& m)
+    {
+        lu_decomposition<T> d = lu(m);
+        tensor<T> inv = lu_solve(d, vtensor<T>::identity(m.shape[0]));
+        if (res.empty()) res = inv;
+        else res.copyValuesFrom(inv);
+        return !d.m_singular;
+    }
+
+    template<class T>
+    T det(const vtensor<T>& a)
+    {
+        lu_decomposition<T> d = lu(a);
+        if (d.m_singular) return T(0);
+        T res = T(d.m_sign);
+        for(tensor_settings::index_type i=0; i<a.shape[0]; ++i) res *= d.m_lu[{i,i}];
+        return res;
+    }
+
+    template<class T>
+    T determinant(const vtensor<T>& a)
+    {
+        return det(a);
+    }
+}
+
+#endif // algotest_tensor_linalg_included
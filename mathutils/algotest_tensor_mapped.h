@@ -0,0 +1,132 @@
+/*  The Mathutil library
+ Copyright (C) 2007-2022 Maksym Davydov
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; version 3
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef algotest_tensor_mapped_included
+#define algotest_tensor_mapped_included
+
+#include "algotest_tensor.h"
+
+#ifdef ALGOTEST_MEMORY_MAPPING_SUPPORTED
+
+#include <cerrno>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+namespace algotest
+{
+    /**
+     @brief npy_mapping maps .npy files into memory.
+     Values are read from the file on demand, so mapped tensors may be larger than RAM.
+     Use for_each_tile / apply_tiled to walk them with bounded resident memory.
+     */
+    class npy_mapping
+    {
+    public:
+        [[noreturn]] static void fail(const std::string& what, const std::string& path)
+        {
+            throw std::runtime_error(what + " " + path + ": " + strerror(errno));
+        }
+
+        /// maps the whole file, values start at data_offset
+        static std::shared_ptr<MappedData> map(const std::string& path, bool writable, size_t data_offset, size_t data_size)
+        {
+            int fd = ::open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+            if (fd<0) fail("npy_mapping: unable to open", path);
+
+            struct stat st;
+            if (fstat(fd, &st)!=0 || size_t(st.st_size) < data_offset + data_size)
+            {
+                close(fd);
+                throw std::runtime_error("npy_mapping: file is truncated " + path);
+            }
+
+            size_t size = size_t(st.st_size);
+            void * p = mmap(0, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);  // the mapping stays valid without the descriptor
+            if (p==MAP_FAILED) fail("npy_mapping: mmap", path);
+            return std::make_shared<MappedData>(p, size, -1);
+        }
+
+        template<class T>
+        static tensor<T> open(const std::string& path, bool writable)
+        {
+            FILE * f = fopen(path.c_str(), "rb");
+            if (!f) fail("npy_mapping: unable to open", path);
+
+            size_t word_size;
+            bool fortran_order;
+            std::vector<size_t> shape;
+            try
+            {
+                cnpy::parse_npy_header(f, word_size, shape, fortran_order);
+            }
+            catch (...)
+            {
+                fclose(f);
+                throw;
+            }
+            size_t data_offset = size_t( ftell(f) );
+            fclose(f);
+
+            ASSERT(word_size == sizeof(T));
+            ASSERT(fortran_order == false);
+
+            tensor_shape ts(shape);
+            auto mapping = map(path, writable, data_offset, size_t(ts.numElements())*sizeof(T));
+            T * data = reinterpret_cast<T*>( static_cast<char*>(mapping->data()) + data_offset );
+            return tensor<T>(ts, data, mapping);
+        }
+    };
+
+    /// Maps .npy file for reading and writing, modifications are written to the file
+    template<class T>
+    tensor<T> npy_map_tensor(const std::string& path)
+    {
+        return npy_mapping::open<T>(path, true);
+    }
+
+    /// Maps .npy file for reading only
+    template<class T>
+    vtensor<const T> npy_map_tensor_readonly(const std::string& path)
+    {
+        return npy_mapping::open<const T>(path, false);
+    }
+
+    /// Creates .npy file of the given shape (values are zeros) and maps it for reading and writing.
+    /// The file is sparse until the values are written, so it can be larger than RAM.
+    template<class T>
+    tensor<T> npy_create_mapped_tensor(const std::string& path, const tensor_shape& shape)
+    {
+        ASSERT(shape.ndim()>0);
+        std::vector<size_t> npy_shape( shape.begin(), shape.end() );
+        std::vector<char> header = cnpy::create_npy_header<T>(npy_shape);
+
+        FILE * f = fopen(path.c_str(), "wb");
+        if (!f) npy_mapping::fail("npy_create_mapped_tensor: unable to create", path);
+        bool ok = fwrite(header.data(), 1, header.size(), f) == header.size();
+        ok = fclose(f)==0 && ok;
+        if (!ok || truncate(path.c_str(), off_t(header.size() + size_t(shape.numElements())*sizeof(T)))!=0)
+        {
+            npy_mapping::fail("npy_create_mapped_tensor: unable to write", path);
+        }
+        return npy_map_tensor<T>(path);
+    }
+}
+
+#endif // ALGOTEST_MEMORY_MAPPING_SUPPORTED
+
+#endif // algotest_tensor_mapped_included
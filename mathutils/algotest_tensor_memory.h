@@ -0,0 +1,283 @@
+/*  The Mathutil library
+ Copyright (C) 2007-2022 Maksym Davydov
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; version 3
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef algotest_tensor_memory_included
+#define algotest_tensor_memory_included
+
+#include <atomic>
+#include <memory>
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+#include <string>
+#include "algotest_memory.h"
+
+#if defined __linux__ || defined __APPLE__
+    #include <sys/mman.h>
+    #include <unistd.h>
+    #define ALGOTEST_MEMORY_MAPPING_SUPPORTED 1
+#endif
+
+#if defined __linux__ && !defined ANDROID_NDK
+    #define ALGOTEST_HUGE_PAGES_SUPPORTED 1
+#endif
+
+// Android has no POSIX shared memory objects (shm_open, shm_unlink), files are still mapped
+#if defined ALGOTEST_MEMORY_MAPPING_SUPPORTED && !defined ANDROID_NDK
+    #define ALGOTEST_SHARED_MEMORY_SUPPORTED 1
+#endif
+
+namespace algotest
+{
+    /// counters of large tensor allocations
+    struct huge_page_stats
+    {
+        size_t m_hugetlb_bytes = 0;     // bytes allocated from explicit huge pages (hugetlbfs)
+        size_t m_thp_bytes = 0;         // bytes in 2MB-aligned regions advised for transparent huge pages
+        size_t m_fallback_bytes = 0;    // bytes of large allocations that fell back to the regular heap
+        size_t m_live_bytes = 0;        // bytes of huge page regions which are not freed yet
+        size_t m_num_allocations = 0;   // number of allocations above the threshold
+    };
+
+    /**
+     @brief huge_page_memory allocates large tensor buffers from 2MB-aligned regions.
+     Buffers of at least threshold() bytes are mapped with MAP_HUGETLB if hugetlbfs usage is enabled,
+     otherwise (or if there are no free huge pages) they are advised for transparent huge pages.
+     Smaller buffers and platforms without huge pages use new[].
+     */
+    class huge_page_memory
+    {
+    public:
+        enum { KHugePageSize = 2 << 20 };
+
+    private:
+        struct counters
+        {
+            std::atomic<size_t> m_threshold { size_t(64) << 20 };
+            std::atomic<bool>   m_use_hugetlbfs { false };
+            std::atomic<size_t> m_hugetlb_bytes { 0 };
+            std::atomic<size_t> m_thp_bytes { 0 };
+            std::atomic<size_t> m_fallback_bytes { 0 };
+            std::atomic<size_t> m_live_bytes { 0 };
+            std::atomic<size_t> m_num_allocations { 0 };
+        };
+
+        static counters& globalCounters()
+        {
+            static counters g_counters;
+            return g_counters;
+        }
+
+        /// owns a region mapped by huge_page_memory
+        class MappedRegion : public AbstractData
+        {
+            void * m_ptr;
+            size_t m_size;
+        public:
+            MappedRegion(void * ptr, size_t size) : m_ptr(ptr), m_size(size) {}
+            MappedRegion(const MappedRegion&) = delete;
+            MappedRegion& operator=(const MappedRegion&) = delete;
+            ~MappedRegion() override
+            {
+#ifdef ALGOTEST_HUGE_PAGES_SUPPORTED
+                munmap(m_ptr, m_size);
+#endif
+                globalCounters().m_live_bytes -= m_size;
+            }
+        };
+
+        static size_t roundUp(size_t size) { return (size + KHugePageSize - 1) / KHugePageSize * KHugePageSize; }
+
+        static void * mapRegion(size_t size)
+        {
+#ifdef ALGOTEST_HUGE_PAGES_SUPPORTED
+            #ifdef MAP_HUGETLB
+            if (globalCounters().m_use_hugetlbfs)
+            {
+                void * p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if (p!=MAP_FAILED)
+                {
+                    globalCounters().m_hugetlb_bytes += size;
+                    return p;
+                }
+            }
+            #endif
+
+            // over-allocate to cut out a 2MB-aligned region
+            size_t mapped_size = size + KHugePageSize;
+            void * p = mmap(0, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (p==MAP_FAILED) return 0;
+
+            char * begin = static_cast<char*>(p);
+            char * aligned = reinterpret_cast<char*>( roundUp( reinterpret_cast<size_t>(begin) ) );
+            char * end = begin + mapped_size;
+            if (aligned != begin) munmap(begin, aligned - begin);
+            if (aligned + size != end) munmap(aligned + size, end - (aligned + size));
+
+            #ifdef MADV_HUGEPAGE
+            madvise(aligned, size, MADV_HUGEPAGE);
+            #endif
+            globalCounters().m_thp_bytes += size;
+            return aligned;
+#else
+            return 0;
+#endif
+        }
+
+    public:
+        /// buffers of at least threshold bytes are allocated from huge pages, 0 disables huge pages
+        static void setThreshold(size_t bytes) { globalCounters().m_threshold = bytes; }
+        static size_t threshold() { return globalCounters().m_threshold; }
+
+        /// try explicit huge pages (they should be reserved in /proc/sys/vm/nr_hugepages) before transparent ones
+        static void useHugetlbfs(bool use) { globalCounters().m_use_hugetlbfs = use; }
+
+        static huge_page_stats stats()
+        {
+            huge_page_stats s;
+            s.m_hugetlb_bytes = globalCounters().m_hugetlb_bytes;
+            s.m_thp_bytes = globalCounters().m_thp_bytes;
+            s.m_fallback_bytes = globalCounters().m_fallback_bytes;
+            s.m_live_bytes = globalCounters().m_live_bytes;
+            s.m_num_allocations = globalCounters().m_num_allocations;
+            return s;
+        }
+
+        /// size of process memory actually backed by transparent huge pages (AnonHugePages), 0 if unknown
+        static size_t anonHugePagesBytes()
+        {
+#ifdef ALGOTEST_HUGE_PAGES_SUPPORTED
+            FILE * f = fopen("/proc/self/smaps_rollup", "r");
+            if (!f) return 0;
+            char line[256];
+            size_t kb = 0;
+            while (fgets(line, sizeof(line), f))
+            {
+                if (sscanf(line, "AnonHugePages: %zu kB", &kb)==1) break;
+            }
+            fclose(f);
+            return kb*1024;
+#else
+            return 0;
+#endif
+        }
+
+        /// allocates an array of n elements and returns its data holder
+        template<class T>
+        static T * allocate(size_t n, std::shared_ptr<AbstractData>& holder)
+        {
+            size_t size = n*sizeof(T);
+            size_t threshold = globalCounters().m_threshold;
+
+            if constexpr (std::is_trivially_default_constructible_v<T> && std::is_trivially_destructible_v<T>)
+            {
+                if (threshold!=0 && size>=threshold)
+                {
+                    ++globalCounters().m_num_allocations;
+                    size_t region_size = roundUp(size);
+                    if (void * p = mapRegion(region_size))
+                    {
+                        globalCounters().m_live_bytes += region_size;
+                        holder = std::make_shared<MappedRegion>(p, region_size);
+                        return static_cast<T*>(p);
+                    }
+                    globalCounters().m_fallback_bytes += size;
+                }
+            }
+
+            T * data = new T[n];
+            holder = abstractDataHolder(ArrayPtr<T>(data));
+            return data;
+        }
+    };
+
+    /**
+     @brief tensor_memory_budget limits temporary buffers of tensor operations (softmax and others).
+     If the temporaries of an operation do not fit into the budget, the operation processes the tensor
+     in chunks along an axis that is not reduced. The result itself is not counted. 0 means unlimited.
+     */
+    class tensor_memory_budget
+    {
+        static std::atomic<size_t>& globalBudget()
+        {
+            static std::atomic<size_t> g_budget { 0 };
+            return g_budget;
+        }
+    public:
+        static void set(size_t bytes) { globalBudget() = bytes; }
+        static size_t get() { return globalBudget(); }
+    };
+
+    /// hints for memory-mapped tensors, they are ignored for other tensors
+    enum mapped_memory_advice { KAdviseSequential, KAdviseWillNeed, KAdviseRelease };
+
+#ifdef ALGOTEST_MEMORY_MAPPING_SUPPORTED
+    /// MappedData owns a memory mapping of a file or a shared memory object and its file descriptor.
+    /// It is used as a data holder of tensors that reference mapped memory.
+    class MappedData : public AbstractData
+    {
+        void * m_ptr;
+        size_t m_size;
+        int m_fd;
+        std::string m_unlink_name;  // shared memory object to unlink on release
+    public:
+        MappedData(void * ptr, size_t size, int fd, std::string unlink_name = std::string())
+            : m_ptr(ptr), m_size(size), m_fd(fd), m_unlink_name(std::move(unlink_name)) {}
+        MappedData(const MappedData&) = delete;
+        MappedData& operator=(const MappedData&) = delete;
+        ~MappedData() override
+        {
+            munmap(m_ptr, m_size);
+            if (m_fd>=0) close(m_fd);
+#ifdef ALGOTEST_SHARED_MEMORY_SUPPORTED
+            if (!m_unlink_name.empty()) shm_unlink(m_unlink_name.c_str());
+#endif
+        }
+
+        void * data() const { return m_ptr; }
+        size_t size() const { return m_size; }
+        int fd() const { return m_fd; }
+
+    public:
+        /// gives a hint about future usage of a range of mapped memory.
+        /// KAdviseRelease writes modified pages back asynchronously and drops the range from resident memory,
+        /// the values stay in the file (all mappings are MAP_SHARED).
+        static void advise(const void * ptr, size_t size, mapped_memory_advice a)
+        {
+            static const size_t page = size_t( sysconf(_SC_PAGESIZE) );
+            size_t b = reinterpret_cast<size_t>(ptr);
+            size_t e = b + size;
+            b = b/page*page;
+            // do not drop the last partial page, it may belong to the next range
+            e = a==KAdviseRelease ? e/page*page : (e+page-1)/page*page;
+            if (e<=b) return;
+
+            void * p = reinterpret_cast<void*>(b);
+            switch(a)
+            {
+                case KAdviseSequential: madvise(p, e-b, MADV_SEQUENTIAL); break;
+                case KAdviseWillNeed:   madvise(p, e-b, MADV_WILLNEED); break;
+                case KAdviseRelease:
+                    msync(p, e-b, MS_ASYNC);
+                    madvise(p, e-b, MADV_DONTNEED);
+                    break;
+            }
+        }
+    };
+#endif
+}
+
+#endif // algotest_tensor_memory_included
@@ -0,0 +1,239 @@
+/*  The Mathutil library
+ Copyright (C) 2007-2022 Maksym Davydov
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; version 3
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef algotest_tensor_shared_included
+#define algotest_tensor_shared_included
+
+#include "algotest_tensor.h"
+
+#ifdef ALGOTEST_SHARED_MEMORY_SUPPORTED
+
+#include <cerrno>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+namespace algotest
+{
+    /**
+     @brief shared_tensor_storage places tensors into POSIX shared memory objects or memfd files,
+     so several processes can map the same values without copying.
+     The object starts with a page that describes the tensor, values are stored after it.
+     */
+    class shared_tensor_storage : public tensor_settings
+    {
+    public:
+        enum { KMagic = 0x53544741, KMaxDims = 32, KDataOffset = 4096 };
+
+        struct header
+        {
+            uint32_t m_magic;
+            uint32_t m_word_size;
+            int32_t  m_ndim;
+            int32_t  m_shape[KMaxDims];
+        };
+
+        [[noreturn]] static void fail(const std::string& what)
+        {
+            throw std::runtime_error(what + ": " + strerror(errno));
+        }
+
+        static size_t byteSize(const tensor_shape& shape, size_t word_size)
+        {
+            return KDataOffset + size_t(shape.numElements())*word_size;
+        }
+
+        /// maps fd and takes ownership of it, the mapping is released with the last tensor referencing it
+        static std::shared_ptr<MappedData> map(int fd, size_t size, bool writable, std::string unlink_name = std::string())
+        {
+            void * p = mmap(0, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+            if (p==MAP_FAILED)
+            {
+                int err = errno;
+                close(fd);
+                errno = err;
+                fail("shared tensor mmap");
+            }
+            return std::make_shared<MappedData>(p, size, fd, std::move(unlink_name));
+        }
+
+        static std::shared_ptr<MappedData> create(int fd, const tensor_shape& shape, size_t word_size, std::string unlink_name)
+        {
+            ASSERT(shape.ndim() <= KMaxDims);
+            size_t size = byteSize(shape, word_size);
+            if (ftruncate(fd, off_t(size))!=0)
+            {
+                int err = errno;
+                close(fd);
+                if (!unlink_name.empty()) shm_unlink(unlink_name.c_str());
+                errno = err;
+                fail("shared tensor ftruncate");
+            }
+
+            std::shared_ptr<MappedData> mapping = map(fd, size, true, std::move(unlink_name));
+            header * h = static_cast<header*>(mapping->data());
+            h->m_word_size = uint32_t(word_size);
+            h->m_ndim = shape.ndim();
+            for(int i=0; i<shape.ndim(); ++i) h->m_shape[i] = shape[i];
+            h->m_magic = KMagic;
+            return mapping;
+        }
+
+        static std::shared_ptr<MappedData> open(int fd, size_t word_size, bool writable, tensor_shape& shape)
+        {
+            struct stat st;
+            if (fstat(fd, &st)!=0 || size_t(st.st_size) < KDataOffset)
+            {
+                close(fd);
+                throw std::runtime_error("shared tensor: not a tensor object");
+            }
+
+            std::shared_ptr<MappedData> mapping = map(fd, size_t(st.st_size), writable);
+            const header * h = static_cast<const header*>(mapping->data());
+            if (h->m_magic!=KMagic || h->m_ndim<0 || h->m_ndim>KMaxDims)
+            {
+                throw std::runtime_error("shared tensor: not a tensor object");
+            }
+            if (h->m_word_size != word_size)
+            {
+                throw std::runtime_error("shared tensor: element size does not match");
+            }
+
+            // the header stores int32_t sizes whatever index_type is
+            std::vector<index_type> sizes( size_t(h->m_ndim) );
+            for(int i=0; i<h->m_ndim; ++i)
+            {
+                if (h->m_shape[i]<0) throw std::runtime_error("shared tensor: not a tensor object");
+                sizes[i] = index_type( h->m_shape[i] );
+            }
+            shape = tensor_shape(sizes);
+            if (byteSize(shape, word_size) > mapping->size())
+            {
+                throw std::runtime_error("shared tensor: object is truncated");
+            }
+            return mapping;
+        }
+
+        static int openNamed(const std::string& name, bool writable)
+        {
+            int fd = shm_open(name.c_str(), writable ? O_RDWR : O_RDONLY, 0);
+            if (fd<0) fail("shm_open " + name);
+            return fd;
+        }
+
+        template<class T>
+        static tensor<T> makeTensor(const tensor_shape& shape, const std::shared_ptr<MappedData>& mapping)
+        {
+            T * data = reinterpret_cast<T*>( static_cast<char*>(mapping->data()) + KDataOffset );
+            return tensor<T>(shape, data, mapping);
+        }
+    };
+
+    /// Creates a tensor in a new POSIX shared memory object (name should start with '/').
+    /// Other processes can map it with shm_open_tensor(name) while the name exists.
+    /// If unlink_on_release is true the name is removed when the last tensor referencing the memory is released.
+    template<class T>
+    tensor<T> shm_create_tensor(const std::string& name, const tensor_shape& shape, bool unlink_on_release = true)
+    {
+        int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd<0) shared_tensor_storage::fail("shm_open " + name);
+        return shared_tensor_storage::makeTensor<T>(shape,
+                    shared_tensor_storage::create(fd, shape, sizeof(T), unlink_on_release ? name : std::string()));
+    }
+
+    /// Copies values of the tensor into a new shared memory object.
+    /// Fill the tensor returned by shm_create_tensor directly to avoid this copy.
+    template<class T>
+    tensor<T> shm_publish_tensor(const std::string& name, const vtensor<T>& t, bool unlink_on_release = true)
+    {
+        tensor<T> res = shm_create_tensor<T>(name, t.shape, unlink_on_release);
+        res.copyValuesFrom(t);
+        return res;
+    }
+
+    /// Maps a tensor published by another process for reading and writing.
+    template<class T>
+    tensor<T> shm_open_tensor(const std::string& name)
+    {
+        tensor_shape shape;
+        auto mapping = shared_tensor_storage::open(shared_tensor_storage::openNamed(name, true), sizeof(T), true, shape);
+        return shared_tensor_storage::makeTensor<T>(shape, mapping);
+    }
+
+    /// Maps a tensor published by another process for reading only.
+    template<class T>
+    vtensor<const T> shm_open_tensor_readonly(const std::string& name)
+    {
+        tensor_shape shape;
+        auto mapping = shared_tensor_storage::open(shared_tensor_storage::openNamed(name, false), sizeof(T), false, shape);
+        return shared_tensor_storage::makeTensor<const T>(shape, mapping);
+    }
+
+    /// Removes the name of a shared memory object. Processes that mapped it keep the values.
+    inline void shm_unlink_tensor(const std::string& name)
+    {
+        shm_unlink(name.c_str());
+    }
+
+#ifdef __linux__
+    /// Creates a tensor in an anonymous memfd file. Pass shared_tensor_fd() to other processes
+    /// (via fork or SCM_RIGHTS) to map the same memory with fd_open_tensor().
+    template<class T>
+    tensor<T> memfd_create_tensor(const tensor_shape& shape, const char * debug_name = "algotest_tensor")
+    {
+        int fd = memfd_create(debug_name, MFD_CLOEXEC);
+        if (fd<0) shared_tensor_storage::fail("memfd_create");
+        return shared_tensor_storage::makeTensor<T>(shape, shared_tensor_storage::create(fd, shape, sizeof(T), std::string()));
+    }
+#endif
+
+    /// Maps a tensor from a file descriptor of a shared memory object for reading and writing.
+    /// The descriptor is duplicated, so the caller keeps the ownership of fd.
+    template<class T>
+    tensor<T> fd_open_tensor(int fd)
+    {
+        int own_fd = dup(fd);
+        if (own_fd<0) shared_tensor_storage::fail("dup");
+        tensor_shape shape;
+        auto mapping = shared_tensor_storage::open(own_fd, sizeof(T), true, shape);
+        return shared_tensor_storage::makeTensor<T>(shape, mapping);
+    }
+
+    /// Maps a tensor from a file descriptor of a shared memory object for reading only.
+    template<class T>
+    vtensor<const T> fd_open_tensor_readonly(int fd)
+    {
+        int own_fd = dup(fd);
+        if (own_fd<0) shared_tensor_storage::fail("dup");
+        tensor_shape shape;
+        auto mapping = shared_tensor_storage::open(own_fd, sizeof(T), false, shape);
+        return shared_tensor_storage::makeTensor<const T>(shape, mapping);
+    }
+
+    /// returns file descriptor of the shared memory that holds the tensor or -1 for other tensors
+    template<class T>
+    int shared_tensor_fd(const vtensor<T>& t)
+    {
+        std::shared_ptr<MappedData> mapping = std::dynamic_pointer_cast<MappedData>(t.dataHolder());
+        return mapping ? mapping->fd() : -1;
+    }
+}
+
+#endif // ALGOTEST_SHARED_MEMORY_SUPPORTED
+
+#endif // algotest_tensor_shared_included
@@ -0,0 +1,350 @@
+/*  The Mathutil library
+ Copyright (C) 2007-2022 Maksym Davydov
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; version 3
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef algotest_tensor_sort_included
+#define algotest_tensor_sort_included
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "algotest_tensor.h"
+
+namespace algotest
+{
+    template<class T>
+    struct topk_result
+    {
+        tensor<T> m_values;
+        tensor<tensor_settings::index_type> m_indices;
+    };
+
+    /// order-preserving unsigned keys of numbers for the radix sort
+    template<class T, class = void>
+    struct radix_traits { enum { KEnabled = 0 }; typedef uint32_t key_type; };
+
+    template<class T>
+    struct radix_traits<T, std::enable_if_t< std::is_arithmetic_v<T> && sizeof(T)<=8 > >
+    {
+        enum { KEnabled = 1, KBits = 8*sizeof(T) };
+        typedef std::conditional_t< sizeof(T)==1, uint8_t,
+                std::conditional_t< sizeof(T)==2, uint16_t,
+                std::conditional_t< sizeof(T)==4, uint32_t, uint64_t > > > key_type;
+
+        static key_type key(const T& v, bool descending)
+        {
+            key_type bits, sign = key_type( key_type(1) << (KBits-1) );
+            if constexpr (std::is_floating_point_v<T>)
+            {
+                // negative values have all bits inverted, positive values get the sign bit
+                memcpy(&bits, &v, sizeof(T));
+                bits = (bits & sign) ? key_type(~bits) : key_type(bits | sign);
+            }
+            else if constexpr (std::is_signed_v<T>) bits = key_type( key_type(v) ^ sign );
+            else bits = key_type(v);
+            return descending ? key_type(~bits) : bits;
+        }
+    };
+
+    /**
+     @brief tensor_sort implements selection and sorting of lines along an axis.
+     Lines are addressed by the displacements of their first elements, so any strides work
+     and lines are distributed between threads without copying the tensor.
+     */
+    class tensor_sort : public tensor_settings
+    {
+    public:
+        enum { KHeapRatio = 8, KMinRadixSort = 256, KMinParallelSort = 1<<16 };
+
+        /// value and its index in the line
+        template<class T>
+        struct entry
+        {
+            T m_value;
+            index_type m_index;
+        };
+
+        /// displacements of the first elements of all lines along the axis, in row-major order of other axes
+        template<class T>
+        static std::vector<index_type> lineOffsets(const vtensor<T>& t, int axis)
+        {
+            std::vector<index_type> res;
+            res.reserve( size_t(t.numElements()/std::max(1, t.shape[axis])) );
+            const T * base = t.data();
+            const vtensor<T> lines = t.destroyAxis(axis);
+            lines.apply( [&res, base](const T& first) { res.push_back( index_type(&first - base) ); } );
+            return res;
+        }
+
+        /// a precedes b: better value first, smaller index on ties
+        template<class T>
+        static bool precedes(const entry<T>& a, const entry<T>& b, bool largest)
+        {
+            if (a.m_value==b.m_value) return a.m_index < b.m_index;
+            return largest ? b.m_value < a.m_value : a.m_value < b.m_value;
+        }
+
+        /** @brief selects k best entries of the line into buffer[0..k).
+         For small k a heap of the k best entries is kept while the line is read once
+         (its top is the worst of them and is replaced by better values),
+         otherwise all entries are copied and partitioned by quickselect (nth_element).
+         */
+        template<class T>
+        static void selectLine(const T * src, index_type stride, index_type n, index_type k,
+                               bool largest, bool sorted, std::vector< entry<T> >& buffer)
+        {
+            auto less = [largest](const entry<T>& a, const entry<T>& b) { return precedes(a, b, largest); };
+            buffer.clear();
+
+            if (k*KHeapRatio <= n)
+            {
+                for(index_type i=0; i<k; ++i) buffer.push_back( entry<T>{ src[i*stride], i } );
+                std::make_heap(buffer.begin(), buffer.end(), less);
+                for(index_type i=k; i<n; ++i)
+                {
+                    entry<T> e { src[i*stride], i };
+                    if (!less(e, buffer.front())) continue;
+                    std::pop_heap(buffer.begin(), buffer.end(), less);
+                    buffer.back() = e;
+                    std::push_heap(buffer.begin(), buffer.end(), less);
+                }
+                if (sorted) std::sort_heap(buffer.begin(), buffer.end(), less);
+                return;
+            }
+
+            for(index_type i=0; i<n; ++i) buffer.push_back( entry<T>{ src[i*stride], i } );
+            if (k<n) std::nth_element(buffer.begin(), buffer.begin()+k-1, buffer.end(), less);
+            if (sorted) std::sort(buffer.begin(), buffer.begin()+k, less);
+        }
+
+        template<class T>
+        static topk_result<T> topk(const vtensor<T>& t, index_type k, int axis, bool largest, bool sorted)
+        {
+            t.makeAxisIndexPositive(axis);
+            index_type n = t.shape[axis];
+            ASSERT(k>0 && k<=n);
+
+            tensor_shape res_shape = t.shape.copyShape();
+            res_shape[axis] = k;
+            topk_result<T> res { tensor<T>(res_shape), tensor<index_type>(res_shape) };
+
+            std::vector<index_type> src_lines = lineOffsets(t, axis);
+            std::vector<index_type> dst_lines = lineOffsets<T>(res.m_values, axis);
+            const T * src = t.data();
+            T * values = res.m_values.data();
+            index_type * indices = res.m_indices.data();
+            index_type ss = t.stride(axis), ds = res.m_values.stride(axis);
+
+            sysutils::runForThreads(sysutils::KNumThreadsAuto, 0, int(src_lines.size()), [&](int beg, int end)
+                {
+                    std::vector< entry<T> > buffer;
+                    for(int line=beg; line<end; ++line)
+                    {
+                        selectLine(src + src_lines[line], ss, n, k, largest, sorted, buffer);
+                        for(index_type i=0; i<k; ++i)
+                        {
+                            values[dst_lines[line] + i*ds] = buffer[i].m_value;
+                            indices[dst_lines[line] + i*ds] = buffer[i].m_index;
+                        }
+                    }
+                });
+            return res;
+        }
+
+        template<class T>
+        struct radix_item
+        {
+            typename radix_traits<T>::key_type m_key;
+            index_type m_index;
+        };
+
+        /// per-thread buffers of sortRange
+        template<class T>
+        struct workspace
+        {
+            std::vector< radix_item<T> > m_items, m_tmp;
+        };
+
+        /// least significant digit radix sort by bytes, passes where all keys share the byte are skipped
+        template<class T>
+        static void radixSort(std::vector< radix_item<T> >& items, std::vector< radix_item<T> >& tmp)
+        {
+            size_t n = items.size();
+            tmp.resize(n);
+            for(int shift=0; shift<radix_traits<T>::KBits; shift+=8)
+            {
+                size_t count[257] = {};
+                for(const radix_item<T>& it : items) ++count[ ((it.m_key >> shift) & 255) + 1 ];
+                if (std::find(count+1, count+257, n) != count+257) continue;
+                for(int d=0; d<256; ++d) count[d+1] += count[d];
+                for(const radix_item<T>& it : items) tmp[ count[(it.m_key >> shift) & 255]++ ] = it;
+                items.swap(tmp);
+            }
+        }
+
+        /** @brief sorts positions [b, e) of a line into out (values with their indices in the line).
+         Long lines of numbers use the radix sort (stable), others are sorted by comparisons:
+         by values only, or by values and indices if the sort should be stable.
+        */
+        template<class T>
+        static void sortRange(const T * src, index_type stride, index_type b, index_type e,
+                              bool descending, bool stable, workspace<T>& ws, entry<T> * out)
+        {
+            index_type n = e-b;
+            if constexpr (radix_traits<T>::KEnabled)
+            {
+                if (n >= KMinRadixSort)
+                {
+                    ws.m_items.resize( static_cast<size_t>(n) );
+                    for(index_type i=0; i<n; ++i)
+                    {
+                        ws.m_items[i] = radix_item<T>{ radix_traits<T>::key(src[(b+i)*stride], descending), b+i };
+                    }
+                    radixSort(ws.m_items, ws.m_tmp);
+                    for(index_type i=0; i<n; ++i)
+                    {
+                        index_type index = ws.m_items[i].m_index;
+                        out[i] = entry<T>{ src[index*stride], index };
+                    }
+                    return;
+                }
+            }
+
+            for(index_type i=0; i<n; ++i) out[i] = entry<T>{ src[(b+i)*stride], b+i };
+            if (stable) std::sort(out, out+n, [descending](const entry<T>& x, const entry<T>& y) { return precedes(x, y, descending); });
+            else std::sort(out, out+n, valueLess<T>(descending));
+        }
+
+        template<class T>
+        static auto valueLess(bool descending)
+        {
+            return [descending](const entry<T>& x, const entry<T>& y)
+                   { return descending ? y.m_value < x.m_value : x.m_value < y.m_value; };
+        }
+
+        /** @brief sorts lines along the axis, writes sorted values and/or their indices (either may be null).
+         Many lines are sorted in parallel one line per thread. A long line when there are fewer lines than threads
+         is split into parts sorted in parallel and merged pairwise in parallel rounds (merges keep the order
+         of equal values, so the result is stable if the parts are).
+        */
+        template<class T>
+        static void sortLines(const vtensor<T>& t, int axis, bool descending, bool stable,
+                              vtensor<T> * values, vtensor<index_type> * indices)
+        {
+            index_type n = t.shape[axis];
+            std::vector<index_type> src_lines = lineOffsets(t, axis);
+            std::vector<index_type> dst_lines = values ? lineOffsets(*values, axis) : lineOffsets(*indices, axis);
+            const T * src = t.data();
+            T * dst_values = values ? values->data() : nullptr;
+            index_type * dst_indices = indices ? indices->data() : nullptr;
+            index_type ss = t.stride(axis), ds = values ? values->stride(axis) : indices->stride(axis);
+
+            auto store = [&](int line, const entry<T> * sorted)
+            {
+                index_type d = dst_lines[line];
+                if (dst_values) for(index_type i=0; i<n; ++i) dst_values[d + i*ds] = sorted[i].m_value;
+                if (dst_indices) for(index_type i=0; i<n; ++i) dst_indices[d + i*ds] = sorted[i].m_index;
+            };
+
+            int num_threads = sysutils::getOptimalParallelThreads();
+            int num_lines = int(src_lines.size());
+            if (num_lines >= num_threads || n < KMinParallelSort)
+            {
+                sysutils::runForThreads(sysutils::KNumThreadsAuto, 0, num_lines, [&](int beg, int end)
+                    {
+                        workspace<T> ws;
+                        std::vector< entry<T> > sorted( static_cast<size_t>(n) );
+                        for(int line=beg; line<end; ++line)
+                        {
+                            sortRange(src + src_lines[line], ss, 0, n, descending, stable, ws, sorted.data());
+                            store(line, sorted.data());
+                        }
+                    });
+                return;
+            }
+
+            std::vector< entry<T> > sorted( static_cast<size_t>(n) ), merged( static_cast<size_t>(n) );
+            auto part = [n, num_threads](int p) { return index_type( int64_t(n)*p/num_threads ); };
+            for(int line=0; line<num_lines; ++line)
+            {
+                const T * line_src = src + src_lines[line];
+                sysutils::runForThreads(num_threads, 0, num_threads, [&](int beg, int end)
+                    {
+                        workspace<T> ws;
+                        for(int p=beg; p<end; ++p)
+                        {
+                            sortRange(line_src, ss, part(p), part(p+1), descending, stable, ws, sorted.data() + part(p));
+                        }
+                    });
+
+                for(int width=1; width<num_threads; width*=2)
+                {
+                    int num_pairs = (num_threads + 2*width - 1)/(2*width);
+                    sysutils::runForThreads(num_pairs, 0, num_pairs, [&](int beg, int end)
+                        {
+                            for(int pair=beg; pair<end; ++pair)
+                            {
+                                index_type b = part(2*pair*width);
+                                index_type m = part(std::min(num_threads, (2*pair+1)*width));
+                                index_type e = part(std::min(num_threads, (2*pair+2)*width));
+                                std::merge(sorted.begin()+b, sorted.begin()+m, sorted.begin()+m, sorted.begin()+e,
+                                           merged.begin()+b, valueLess<T>(descending));
+                            }
+                        });
+                    sorted.swap(merged);
+                }
+                store(line, sorted.data());
+            }
+        }
+    };
+
+    /** @brief k largest (or smallest) values along the axis and their indices.
+     Lines are processed in parallel, ties are resolved to smaller indices.
+     If sorted is false the order of the selected values is unspecified.
+    */
+    template<class T>
+    topk_result<T> topk(const vtensor<T>& t, tensor_settings::index_type k, int axis = -1,
+                        bool largest = true, bool sorted = true)
+    {
+        return tensor_sort::topk(t, k, axis, largest, sorted);
+    }
+
+    /** @brief values sorted along the axis (ascending or descending).
+     Lines of numbers are sorted by the radix sort, other types by comparisons; stable keeps the order of equal values.
+    */
+    template<class T>
+    tensor<T> sort(const vtensor<T>& t, int axis = -1, bool descending = false, bool stable = false)
+    {
+        t.makeAxisIndexPositive(axis);
+        tensor<T> res( t.shape.copyShape() );
+        tensor_sort::sortLines<T>(t, axis, descending, stable, &res, nullptr);
+        return res;
+    }
+
+    /// indices that sort values along the axis, see sort
+    template<class T>
+    tensor<tensor_settings::index_type> argsort(const vtensor<T>& t, int axis = -1, bool descending = false, bool stable = false)
+    {
+        t.makeAxisIndexPositive(axis);
+        tensor<tensor_settings::index_type> res( t.shape.copyShape() );
+        tensor_sort::sortLines<T>(t, axis, descending, stable, nullptr, &res);
+        return res;
+    }
+}
+
+#endif // algotest_tensor_sort_included
@@ -0,0 +1,249 @@
+/*  The Mathutil library
+ Copyright (C) 2007-2022 Maksym Davydov
+
+ This library is free software; you can redistribute it and/or
+ modify it under the terms of the GNU Lesser General Public
+ License as published by the Free Software Foundation; version 3
+
+ This library is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ Lesser General Public License for more details.
+
+ You should have received a copy of the GNU Lesser General Public
+ License along with this library; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef algotest_tensor_sparse_included
+#define algotest_tensor_sparse_included
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "algotest_tensor.h"
+
+namespace algotest
+{
+    /// sparse matrix as a list of (row, col, value) triplets, convenient for construction
+    template<class T>
+    struct coo_matrix
+    {
+        typedef tensor_settings::index_type index_type;
+
+        index_type m_rows = 0, m_cols = 0;
+        std::vector<index_type> m_row;
+        std::vector<index_type> m_col;
+        std::vector<T> m_values;
+
+        coo_matrix() {}
+        coo_matrix(index_type rows, index_type cols) : m_rows(rows), m_cols(cols) {}
+
+        /// duplicates are summed when converted to csr_matrix
+        void add(index_type row, index_type col, const T& value)
+        {
+            ASSERT(row>=0 && row<m_rows && col>=0 && col<m_cols);
+            m_row.push_back(row);
+            m_col.push_back(col);
+            m_values.push_back(value);
+        }
+
+        index_type nnz() const { return index_type(m_values.size()); }
+    };
+
+    /**
+     @brief csr_matrix is a sparse matrix in compressed sparse row format.
+     Non-zeros of row i are m_values[m_row_ptr[i] .. m_row_ptr[i+1]) with sorted columns in m_col.
+     Products with dense tensors split rows between threads by equal amounts of work (non-zeros plus rows),
+     so a few dense rows do not stall one thread.
+     */
+    template<class T>
+    struct csr_matrix
+    {
+        typedef tensor_settings::index_type index_type;
+
+        index_type m_rows = 0, m_cols = 0;
+        std::vector<index_type> m_row_ptr;
+        std::vector<index_type> m_col;
+        std::vector<T> m_values;
+
+        csr_matrix() : m_row_ptr(1, 0) {}
+        csr_matrix(index_type rows, index_type cols) : m_rows(rows), m_cols(cols), m_row_ptr(size_t(rows)+1, 0) {}
+
+        index_type nnz() const { return index_type(m_values.size()); }
+
+        static csr_matrix fromCOO(const coo_matrix<T>& coo)
+        {
+            // counting sort by rows, then columns are sorted and duplicates summed inside every row
+            std::vector<index_type> start( size_t(coo.m_rows)+1, 0 );
+            for(index_type r : coo.m_row) ++start[r+1];
+            for(index_type r=0; r<coo.m_rows; ++r) start[r+1] += start[r];
+
+            std::vector<index_type> next( start.begin(), start.end()-1 );
+            std::vector< std::pair<index_type, T> > entries( coo.m_values.size() );
+            for(size_t e=0; e<coo.m_values.size(); ++e)
+            {
+                entries[ next[coo.m_row[e]]++ ] = { coo.m_col[e], coo.m_values[e] };
+            }
+
+            csr_matrix res(coo.m_rows, coo.m_cols);
+            res.m_col.reserve(entries.size());
+            res.m_values.reserve(entries.size());
+            for(index_type r=0; r<coo.m_rows; ++r)
+            {
+                std::sort(entries.begin()+start[r], entries.begin()+start[r+1],
+                          [](const auto& a, const auto& b) { return a.first < b.first; });
+                for(index_type e=start[r]; e<start[r+1]; ++e)
+                {
+                    if (e>start[r] && entries[e].first==res.m_col.back()) res.m_values.back() += entries[e].second;
+                    else { res.m_col.push_back(entries[e].first); res.m_values.push_back(entries[e].second); }
+                }
+                res.m_row_ptr[r+1] = res.nnz();
+            }
+            return res;
+        }
+
+        coo_matrix<T> toCOO() const
+        {
+            coo_matrix<T> res(m_rows, m_cols);
+            for(index_type r=0; r<m_rows; ++r)
+            {
+                for(index_type p=m_row_ptr[r]; p<m_row_ptr[r+1]; ++p) res.add(r, m_col[p], m_values[p]);
+            }
+            return res;
+        }
+
+        /// keeps values with |value| > threshold, rows are counted and filled in parallel
+        static csr_matrix fromDense(const vtensor<T>& dense, T threshold = T(0))
+        {
+            ASSERT(dense.ndim()==2);
+            csr_matrix res(dense.shape[0], dense.shape[1]);
+            const T * src = dense.data();
+            index_type rs = dense.stride(0), cs = dense.stride(1);
+            auto keep = [threshold](const T& v) { return v > threshold || v < -threshold; };
+
+            sysutils::runForThreads(sysutils::KNumThreadsAuto, 0, res.m_rows, [&](int beg, int end)
+                {
+                    for(index_type r=beg; r<end; ++r)
+                    {
+                        index_type count = 0;
+                        for(index_type c=0; c<res.m_cols; ++c) count += keep(src[r*rs + c*cs]);
+                        res.m_row_ptr[r+1] = count;
+                    }
+                });
+            for(index_type r=0; r<res.m_rows; ++r) res.m_row_ptr[r+1] += res.m_row_ptr[r];
+
+            res.m_col.resize( size_t(res.m_row_ptr.back()) );
+            res.m_values.resize( size_t(res.m_row_ptr.back()) );
+            sysutils::runForThreads(sysutils::KNumThreadsAuto, 0, res.m_rows, [&](int beg, int end)
+                {
+                    for(index_type r=beg; r<end; ++r)
+                    {
+                        index_type p = res.m_row_ptr[r];
+                        for(index_type c=0; c<res.m_cols; ++c)
+                        {
+                            const T& v = src[r*rs + c*cs];
+                            if (keep(v)) { res.m_col[p] = c; res.m_values[p++] = v; }
+                        }
+                    }
+                });
+            return res;
+        }
+
+        tensor<T> toDense() const
+        {
+            tensor<T> res( {m_rows, m_cols}, initializer(T(0)) );
+            T * dst = res.data();
+            forEachRowRange([&](index_type beg, index_type end)
+                {
+                    for(index_type r=beg; r<end; ++r)
+                    {
+                        for(index_type p=m_row_ptr[r]; p<m_row_ptr[r+1]; ++p) dst[r*m_cols + m_col[p]] = m_values[p];
+                    }
+                });
+            return res;
+        }
+
+        /** @brief product with a dense tensor of any strides:
+         SpMV for a vector x (m_cols), SpMM for a matrix x (m_cols x k), the result is contiguous.
+        */
+        tensor<T> multiply(const vtensor<T>& x) const
+        {
+            ASSERT(x.ndim()==1 || x.ndim()==2);
+            ASSERT(x.shape[0]==m_cols);
+            index_type k = x.ndim()==2 ? x.shape[1] : 1;
+            index_type xs = x.stride(0), xc = x.ndim()==2 ? x.stride(1) : 0;
+
+            tensor<T> res( x.ndim()==2 ? tensor_shape{m_rows, k} : tensor_shape{m_rows} );
+            const T * src = x.data();
+            T * dst = res.data();
+
+            forEachRowRange([&](index_type beg, index_type end)
+                {
+                    for(index_type r=beg; r<end; ++r)
+                    {
+                        if (k==1)
+                        {
+                            T sum = 0;
+                            for(index_type p=m_row_ptr[r]; p<m_row_ptr[r+1]; ++p) sum += m_values[p]*src[m_col[p]*xs];
+                            dst[r] = sum;
+                            continue;
+                        }
+                        // accumulate scaled rows of x into the output row
+                        T * out = dst + r*k;
+                        std::fill(out, out+k, T(0));
+                        for(index_type p=m_row_ptr[r]; p<m_row_ptr[r+1]; ++p)
+                        {
+                            T v = m_values[p];
+                            const T * row = src + m_col[p]*xs;
+                            if (xc==1) for(index_type j=0; j<k; ++j) out[j] += v*row[j];
+                            else       for(index_type j=0; j<k; ++j) out[j] += v*row[j*xc];
+                        }
+                    }
+                });
+            return res;
+        }
+
+        /// elementwise product with a dense matrix, the result keeps the sparsity pattern of this matrix
+        csr_matrix mask(const vtensor<T>& dense) const
+        {
+            ASSERT(dense.ndim()==2 && dense.shape[0]==m_rows && dense.shape[1]==m_cols);
+            csr_matrix res = *this;
+            const T * src = dense.data();
+            index_type rs = dense.stride(0), cs = dense.stride(1);
+            forEachRowRange([&](index_type beg, index_type end)
+                {
+                    for(index_type r=beg; r<end; ++r)
+                    {
+                        for(index_type p=m_row_ptr[r]; p<m_row_ptr[r+1]; ++p) res.m_values[p] *= src[r*rs + m_col[p]*cs];
+                    }
+                });
+            return res;
+        }
+
+        /// first row of part p of num_parts when rows are split by equal work (non-zeros plus rows)
+        index_type partitionRow(int p, int num_parts) const
+        {
+            if (p>=num_parts) return m_rows;
+            double target = double(nnz() + m_rows)*p/num_parts;
+            index_type lo = 0, hi = m_rows;
+            while(lo<hi)
+            {
+                index_type mid = (lo+hi)/2;
+                if (m_row_ptr[mid] + mid < target) lo = mid+1; else hi = mid;
+            }
+            return lo;
+        }
+
+        template<class OP>
+        void forEachRowRange(OP&& op) const
+        {
+            int num_parts = sysutils::getOptimalParallelThreads();
+            sysutils::runForThreads(num_parts, 0, num_parts, [&](int beg, int end)
+                {
+                    for(int p=beg; p<end; ++p) op(partitionRow(p, num_parts), partitionRow(p+1, num_parts));
+                });
+        }
+    };
+}
+
+#endif // algotest_tensor_sparse_included
@@ -168,6 +168,17 @@ namespace algotest
             return getDisplace(std::data(index), int(std::size(index)) );
         }
         
+        /// range [lo, hi] of element displacements (some strides may be negative)
+        void displaceRange(index_type& lo, index_type& hi) const
+        {
+            lo = hi = 0;
+            for(int i=0; i<ndim(); ++i)
+            {
+                index_type d = m_strides[i]*(m_shape[i]-1);
+                if (d>0) hi += d; else lo += d;
+            }
+        }
+        
         index_type getDisplaceByAxis(int axis, index_type index) const
         {
             ASSERT(0<=axis && axis<ndim());
@@ -339,6 +350,14 @@ namespace algotest
             m_strides.erase(m_strides.begin() + axis);
             return *this;
         }
+        /// walks axes axis1 and axis2 together: axis1 gets the sum of strides, axis2 is removed
+        tensor_strided_shape& diagonal(int axis1, int axis2)
+        {
+            ASSERT(0<=axis1 && axis1<ndim() && 0<=axis2 && axis2<ndim() && axis1!=axis2);
+            ASSERT(m_shape[axis1]==m_shape[axis2]);
+            m_strides[axis1] += m_strides[axis2];
+            return destroyAxis(axis2);
+        }
         tensor_strided_shape& flip(int axis)
         {
             ASSERT(0<=axis && axis<ndim());
@@ -9,6 +9,16 @@
 #include "algotest_tests.h"
 #include "algotest_timer.h"
 #include "algotest_tensor.h"
+#include "algotest_tensor_shared.h"
+#include "algotest_tensor_mapped.h"
+#include "algotest_tensor_linalg.h"
+#include "algotest_tensor_conv.h"
+#include "algotest_tensor_einsum.h"
+#include "algotest_tensor_sparse.h"
+#include "algotest_tensor_fixed.h"
+#include "algotest_tensor_sort.h"
+#include "algotest_tensor_histogram.h"
+#include "algotest_tensor_distance.h"
 
 using namespace algotest;
 
@@ -365,6 +375,957 @@ DECLARE_TEST(Tensor_window)
                                                             { 7, 8 }}) );
 }
 
+DECLARE_TEST(Tensor_copy_on_write)
+{
+    tensor<int> a = tensor<int>::arange(6).reshape({2,3});
+    a.enableCopyOnWrite();
+    
+    const tensor<int> b = a.copy();
+    TEST_ASSERT( b.data() == std::as_const(a).data() );
+    
+    b.crop({0,0}, {1,3}) = tensor<int>::scalar(0);
+    TEST_ASSERT( b.data() != std::as_const(a).data() );
+    TEST_ASSERT( a == tensor<int>::matrix( { { 0, 1, 2 },
+                                             { 3, 4, 5 } } ) );
+    TEST_ASSERT( b == tensor<int>::matrix( { { 0, 0, 0 },
+                                             { 3, 4, 5 } } ) );
+    
+    // the source gets a private copy as well if it is modified first
+    tensor<int> c = a.copy();
+    tensor<int> row = a.subtensor({1});
+    row.init(7);
+    TEST_ASSERT( a == tensor<int>::matrix( { { 0, 1, 2 },
+                                             { 7, 7, 7 } } ) );
+    TEST_ASSERT( c == tensor<int>::matrix( { { 0, 1, 2 },
+                                             { 3, 4, 5 } } ) );
+    
+    // not shared anymore, so no more copies
+    int * p = c.data();
+    c[{0,0}] = 9;
+    TEST_ASSERT( c.data() == p );
+    
+    // reading a non-const tensor keeps the data shared
+    tensor<int> d = c.copy();
+    int sum = 0;
+    d.apply( [&sum](const int& v) { sum += v; } );
+    TEST_ASSERT( sum == 24 && d.sum() == sum );
+    TEST_ASSERT( std::as_const(d).data() == std::as_const(c).data() );
+    
+    // a shared argument modified by apply of another tensor gets private data
+    tensor<int> e = tensor<int>::zeros({2,3});
+    e.apply(d, [](const int& src, int& dst) { dst = src; });
+    TEST_ASSERT( std::as_const(d).data() != std::as_const(c).data() );
+    TEST_ASSERT( (d == tensor<int>::zeros({2,3})) && (c[{0,0}] == 9) );
+}
+
+DECLARE_TEST(Tensor_huge_pages)
+{
+    size_t old_threshold = huge_page_memory::threshold();
+    huge_page_memory::setThreshold(4 << 20);
+    
+    huge_page_stats before = huge_page_memory::stats();
+    {
+        tensor<float> big( {1024, 1024, 2}, initializer(1.0f) );
+        tensor<float> small( {16, 16}, initializer(1.0f) );
+        TEST_ASSERT( big.sum() == big.numElements() );
+        
+        huge_page_stats after = huge_page_memory::stats();
+        TEST_ASSERT( after.m_num_allocations == before.m_num_allocations + 1 );
+        TEST_ASSERT( after.m_hugetlb_bytes + after.m_thp_bytes + after.m_fallback_bytes >=
+                     before.m_hugetlb_bytes + before.m_thp_bytes + before.m_fallback_bytes + 8*1024*1024 );
+    }
+    TEST_ASSERT( huge_page_memory::stats().m_live_bytes == before.m_live_bytes );
+    
+    huge_page_memory::setThreshold(old_threshold);
+}
+
+#ifdef ALGOTEST_SHARED_MEMORY_SUPPORTED
+DECLARE_TEST(Tensor_shared_memory)
+{
+    std::string name = "/algotest_tensor_" + std::to_string( getpid() );
+    
+    tensor<float> published = shm_create_tensor<float>(name, {3,4});
+    published.copyValuesFrom( tensor<float>::arange(12).reshape({3,4}) );
+    
+    vtensor<const float> reader = shm_open_tensor_readonly<float>(name);
+    TEST_ASSERT( reader.shape == tensor_shape({3,4}) );
+    TEST_ASSERT( tensor<float>::arange(12).reshape({3,4}) == reader );
+    
+    tensor<float> writer = shm_open_tensor<float>(name);
+    writer.crop({1,0}, {2,4}) = tensor<float>::scalar(-1);
+    TEST_ASSERT( (published[{1,2}] == -1) );
+    TEST_ASSERT( shared_tensor_fd(published) >= 0 );
+    TEST_ASSERT( shared_tensor_fd( tensor<float>({2}) ) == -1 );
+    
+    bool thrown = false;
+    try { tensor<double> wrong_type = shm_open_tensor<double>(name); }
+    catch(const std::runtime_error&) { thrown = true; }
+    TEST_ASSERT(thrown);
+    
+#ifdef __linux__
+    tensor<int> anonymous = memfd_create_tensor<int>({5});
+    anonymous.copyValuesFrom( tensor<int>::arange(5) );
+    tensor<int> mapped = fd_open_tensor<int>( shared_tensor_fd(anonymous) );
+    TEST_ASSERT( mapped == tensor<int>::arange(5) );
+#endif
+}
+#endif
+
+#ifdef ALGOTEST_MEMORY_MAPPING_SUPPORTED
+DECLARE_TEST(Tensor_memory_mapped)
+{
+    std::string path = "/tmp/algotest_mapped_" + std::to_string( getpid() ) + ".npy";
+    {
+        tensor<float> t = npy_create_mapped_tensor<float>(path, {300, 40});
+        float i = 0;
+        // tiles of 4 rows
+        t.apply_tiled( [&i](float& v) { v = i++; }, 40*4*sizeof(float) );
+    }
+    
+    vtensor<const float> m = npy_map_tensor_readonly<float>(path);
+    TEST_ASSERT( m.shape == tensor_shape({300, 40}) );
+    TEST_ASSERT( npy_load_tensor<float>(path) == m );
+    
+    double sum = 0;
+    int num_tiles = 0;
+    m.for_each_tile( [&sum, &num_tiles](const vtensor<const float>& tile) { sum += tile.sum<double>(); ++num_tiles; },
+                     1000*sizeof(float) );
+    TEST_ASSERT( num_tiles == 12 );
+    TEST_ASSERT( sum == 12000.0*11999/2 );
+    
+    // views of mapped tensors
+    TEST_ASSERT( m.crop({1,0}, {2,3}) == tensor<float>::array({40, 41, 42}).reshape({1,3}) );
+    TEST_ASSERT( m.transpose().slice({{.i=2}, {.n=2}}) == tensor<float>::array({2, 42}).reshape({1,2}) );
+    TEST_ASSERT( m.window(1, 20, 20).shape == tensor_shape({300, 2, 20}) );
+    
+    // convert tile by tile into another file
+    tensor<double> converted = npy_create_mapped_tensor<double>(path + ".f64.npy", {40, 300});
+    converted.apply_tiled( m.transpose(), [](double& d, const float& f) { d = f; }, 4096 );
+    TEST_ASSERT( (converted[{3, 2}] == 83.0) );
+    
+    remove( (path + ".f64.npy").c_str() );
+    remove( path.c_str() );
+}
+#endif
+
+DECLARE_TEST(Tensor_memory_budget)
+{
+    tensor<float> test = tensor<float>::arange(4*50*30).reshape({4,50,30});
+    test.apply( [](float& v) { v = float(int(v) % 17) * 0.25f; } );
+    tensor<float> s0 = test.softmax(0), s1 = test.softmax(1), s2 = test.softmax(2);
+    
+    // accumulators of the softmax along axis 1 take 4*30*12 bytes, so they are processed in chunks
+    tensor_memory_budget::set(256);
+    TEST_ASSERT( test.softmax(0).allclose(s0) );
+    TEST_ASSERT( test.softmax(1).allclose(s1) );
+    TEST_ASSERT( test.softmax(-1).allclose(s2) );
+    TEST_ASSERT( test.softmax(1).sum(1).allclose( tensor<float>::scalar(1) ) );
+    tensor_memory_budget::set(0);
+    
+    // softmax does not modify values of its argument
+    TEST_ASSERT( test.softmax(1).softmax(1).sum(1).allclose( tensor<float>::scalar(1) ) );
+    TEST_ASSERT( test.max() == 4.0f );
+}
+
+DECLARE_TEST(Tensor_matmul_blocked)
+{
+    auto reference = [](const auto& a, const auto& b)
+    {
+        typedef typename std::decay_t<decltype(a)>::value_type T;
+        tensor<T> res( tensor_shape{ a.shape[0], b.shape[1] }, initializer<T>(0.0) );
+        for(int i=0; i<a.shape[0]; ++i)
+            for(int k=0; k<a.shape[1]; ++k)
+                for(int j=0; j<b.shape[1]; ++j)
+                    res[{i,j}] += a[{i,k}]*b[{k,j}];
+        return res;
+    };
+    
+    // sizes span several cache blocks and partial micro-tiles
+    tensor<float> a = tensor<float>::arange(150*270).reshape({150,270});
+    tensor<float> b = tensor<float>::arange(270*100).reshape({270,100});
+    a.apply( [](float& v) { v = float(int(v*7) % 13) - 6.0f; } );
+    b.apply( [](float& v) { v = float(int(v*5) % 11) - 5.0f; } );
+    tensor<float> ab = reference(a, b);
+    
+    TEST_ASSERT( a.matmul(b) == ab );
+    
+    // transposed and cropped views are multiplied without copies
+    tensor<float> at = a.transpose().contiguous().transpose();
+    TEST_ASSERT( at.matmul(b) == ab );
+    TEST_ASSERT( b.transpose().matmul(a.transpose()) == ab.transpose() );
+    
+    tensor<float> ac = a.crop({3,1}, {50,268}), bc = b.crop({2,7}, {269,40});
+    TEST_ASSERT( ac.matmul(bc) == reference(ac, bc) );
+    
+    TEST_ASSERT( a.astype<double>().matmul(b.astype<double>()) == ab.astype<double>() );
+    TEST_ASSERT( a.matmul<double>(b) == ab.astype<double>() );
+    
+    tensor<int> ai = a.astype<int>().crop({0,0}, {20,30});
+    tensor<int> bi = b.astype<int>().crop({0,0}, {30,17});
+    TEST_ASSERT( ai.matmul(bi) == reference(ai, bi) );
+    
+    TEST_ASSERT( a.crop({0,0}, {5,0}).matmul(b.crop({0,0}, {0,4})) == tensor<float>( tensor_shape{5,4}, initializer<float>(0.0) ) );
+}
+
+DECLARE_TEST(Tensor_matmul_batched)
+{
+    tensor<float> a = tensor<float>::arange(3*4*5*6).reshape({3,4,5,6});
+    tensor<float> b = tensor<float>::arange(4*6*7).reshape({4,6,7});
+    a.apply( [](float& v) { v = float(int(v) % 7) - 3.0f; } );
+    b.apply( [](float& v) { v = float(int(v) % 5) - 2.0f; } );
+    
+    // b is broadcast along the first batch axis
+    tensor<float> c = a.matmul(b);
+    TEST_ASSERT( c.shape == tensor_shape({3,4,5,7}) );
+    for(int i=0; i<3; ++i)
+        for(int j=0; j<4; ++j)
+            TEST_ASSERT( c.subtensor({i,j}) == a.subtensor({i,j}).matmul(b.subtensor({j})) );
+    
+    // size-1 and insertAxis'd batch axes, transposed matrices
+    tensor<float> a1 = a.crop({0,0,0,0}, {3,1,5,6});
+    tensor<float> bt = b.subtensor({1}).transpose().contiguous().transpose().insertAxis(0, 4);
+    tensor<float> c1 = a1.matmul(bt);
+    TEST_ASSERT( c1.shape == tensor_shape({3,4,5,7}) );
+    for(int i=0; i<3; ++i)
+        for(int j=0; j<4; ++j)
+            TEST_ASSERT( c1.subtensor({i,j}) == a.subtensor({i,0}).matmul(b.subtensor({1})) );
+    
+    // many small products are split between threads
+    tensor<double> s = tensor<double>::arange(500*3*3).reshape({500,3,3});
+    tensor<double> s2 = s.matmul(s);
+    TEST_ASSERT( s2.subtensor({499}) == s.subtensor({499}).matmul(s.subtensor({499})) );
+}
+
+DECLARE_TEST(Tensor_Invert200x200_Random0_1)
+{
+    const int n = 200;
+    tensor<double> m = tensor<double>::random({n,n}, 0, 1);
+    tensor<double> r;
+    TEST_ASSERT( invert_with_LU_decomposition(r, m) );
+    
+    TEST_ASSERT( m.matmul(r).allclose( tensor<double>::identity(n), 0.001 ) );
+    TEST_ASSERT( inverse(m).allclose(r) );
+}
+
+DECLARE_TEST(Tensor_LinearEquation)
+{
+    tensor<float> a = tensor<float>::random({14,14}, -10, 20);
+    
+    tensor<float> v = tensor<float>::array({1,7,2,8,0,6,4,1,7,2,8,0,6,4});
+    tensor<float> x = solve(a, v);
+    
+    tensor<float> expected = a.matmul(x.insertAxis(1, 1)).destroyAxis(1);
+    TEST_ASSERT( expected.allclose(v, 0.001f) );
+    
+    // several right-hand sides of a transposed view
+    tensor<double> ad = tensor<double>::random({150,150}, -1, 1).transpose();
+    tensor<double> b = tensor<double>::random({150,7}, -1, 1);
+    TEST_ASSERT( ad.matmul( solve(ad, b) ).allclose(b, 1e-9) );
+}
+
+DECLARE_TEST(Tensor_FindingDeterminant)
+{
+    tensor<double> m33 = tensor<double>::matrix({{1, 2, 4}, {3, 4, 1}, {1, -1, -1}});
+    double det1 = det(m33);
+    double determinant2 = determinant(m33);
+    
+    TEST_ASSERT_FLOAT_EQ(det1, determinant2, 0.001);
+    TEST_ASSERT_FLOAT_EQ(det1, -23.0, 1e-9);
+    TEST_ASSERT( det( tensor<double>::matrix({{1, 2}, {2, 4}}) ) == 0 );
+}
+
+DECLARE_TEST(Tensor_cholesky)
+{
+    const int n = 150;
+    tensor<double> m = tensor<double>::random({n,n}, -1, 1);
+    tensor<double> a = m.matmul(m.transpose()) + tensor<double>::identity(n)*double(n);
+    
+    tensor<double> l = cholesky(a);
+    TEST_ASSERT( l.matmul(l.transpose()).allclose(a, 1e-9) );
+    TEST_ASSERT( l.crop({0,1}, {1,n}).allclose(0.0) );
+    
+    tensor<double> b = tensor<double>::random({n,5}, -1, 1);
+    TEST_ASSERT( a.matmul( cholesky_solve(l, b) ).allclose(b, 1e-9) );
+    TEST_ASSERT( l.matmul( solve_triangular(l, b, true) ).allclose(b, 1e-9) );
+    TEST_ASSERT( l.transpose().matmul( solve_triangular(l, b, true, true) ).allclose(b, 1e-9) );
+    TEST_ASSERT( l.transpose().matmul( solve_triangular(l.transpose(), b, false) ).allclose(b, 1e-9) );
+    
+    // in place on a strided view inside a larger buffer
+    tensor<double> buffer( tensor_shape{n+2, n+3}, initializer(7.0) );
+    tensor<double> view = buffer.crop({1,2}, {n+1,n+2}).transpose();
+    view = a;
+    TEST_ASSERT( cholesky_inplace(view) );
+    TEST_ASSERT( view.allclose(l, 1e-9) );
+    TEST_ASSERT( buffer.crop({0,0}, {1,n+3}).allclose(7.0) );
+    
+    // batch of small matrices
+    tensor<double> batch( tensor_shape{6,4,4} );
+    for(int i=0; i<6; ++i)
+    {
+        tensor<double> mi = tensor<double>::random({4,4}, -1, 1);
+        batch.subtensor({i}) = mi.matmul(mi.transpose()) + tensor<double>::identity(4);
+    }
+    tensor<double> lb = cholesky(batch);
+    TEST_ASSERT( lb.matmul( lb.transpose(1,2) ).allclose(batch, 1e-9) );
+    
+    TEST_ASSERT( !cholesky_inplace( tensor<double>::matrix({{1, 2}, {2, 1}}) ) );
+}
+
+DECLARE_TEST(Tensor_qr_lstsq)
+{
+    tensor<double> a = tensor<double>::random({200,130}, -1, 1);
+    qr_decomposition<double> d = qr(a);
+    tensor<double> q = qr_q(d), r = qr_r(d);
+    TEST_ASSERT( q.shape == tensor_shape({200,130}) && r.shape == tensor_shape({130,130}) );
+    TEST_ASSERT( q.transpose().matmul(q).allclose( tensor<double>::identity(130), 1e-9 ) );
+    TEST_ASSERT( q.matmul(r).allclose(a, 1e-9) );
+    TEST_ASSERT( r.crop({1,0}, {2,1}).allclose(0.0) );
+    
+    tensor<double> wide = tensor<double>::random({50,80}, -1, 1);
+    qr_decomposition<double> dw = qr(wide);
+    TEST_ASSERT( qr_q(dw).matmul(qr_r(dw)).allclose(wide, 1e-9) );
+    
+    // consistent systems are solved exactly
+    tensor<double> x = tensor<double>::random({130,3}, -1, 1);
+    TEST_ASSERT( lstsq(a, a.matmul(x)).allclose(x, 1e-9) );
+    
+    tensor<double> tall = tensor<double>::random({4000,8}, -1, 1);
+    tensor<double> xt = tensor<double>::array({1,2,3,4,5,6,7,8});
+    tensor<double> bt = tall.matmul(xt.insertAxis(1,1)).destroyAxis(1);
+    TEST_ASSERT( lstsq(tall, bt).allclose(xt, 1e-9) );
+    
+    // residual of the least squares solution is orthogonal to the columns
+    bt += tensor<double>::random({4000}, -0.1, 0.1);
+    tensor<double> ls = lstsq(tall, bt);
+    tensor<double> residual = bt - tall.matmul(ls.insertAxis(1,1)).destroyAxis(1);
+    TEST_ASSERT( tall.transpose().matmul(residual.insertAxis(1,1)).allclose(0.0, 1e-9) );
+    
+    // TSQR over row blocks gives the same R up to signs of rows and the same solution
+    tensor<double> at = tall.deepCopy(), btc = bt.deepCopy().insertAxis(1,1);
+    tensor_linalg::factorizeTSQR(at.matrixRef(), 4000, 8, btc.matrixRef(), 1, 4);
+    tensor<double> rt = at.crop({0,0}, {8,8});
+    solve_triangular_inplace(rt, btc.crop({0,0}, {8,1}), false);
+    TEST_ASSERT( btc.crop({0,0}, {8,1}).destroyAxis(1).allclose(ls, 1e-9) );
+    TEST_ASSERT( rt.transpose().matmul(rt).allclose( tall.transpose().matmul(tall), 1e-8 ) );
+}
+
+DECLARE_TEST(Tensor_randomized_svd)
+{
+    // largest absolute value in every row, 1 for rows of an orthogonal matrix up to signs
+    auto abs_max = [](const tensor<double>& t)
+    {
+        tensor<double> res = t.deepCopy();
+        res.apply( [](double& v) { v = fabs(v); } );
+        return res.max(1);
+    };
+    
+    tensor<double> a = tensor<double>::random({40,25}, -1, 1);
+    svd_decomposition<double> full = svd(a);
+    TEST_ASSERT( full.m_u.matmul( full.m_vt * full.m_s.insertAxis(1,1) ).allclose(a, 1e-9) );
+    TEST_ASSERT( full.m_u.transpose().matmul(full.m_u).allclose( tensor<double>::identity(25), 1e-9 ) );
+    TEST_ASSERT( svd(a.transpose()).m_s.allclose(full.m_s, 1e-9) );
+    
+    // matrix of rank 5 with known singular values
+    tensor<double> u = orthonormalize( tensor<double>::random({300,5}, -1, 1) );
+    tensor<double> v = orthonormalize( tensor<double>::random({120,5}, -1, 1) );
+    tensor<double> s = tensor<double>::array({50, 20, 10, 5, 1});
+    tensor<double> low_rank = (u * s.insertAxis(0,1)).matmul(v.transpose());
+    
+    svd_decomposition<double> r = randomized_svd(low_rank, 3);
+    TEST_ASSERT( r.m_s.allclose( s.cropAxis(0, 0, 3), 1e-8 ) );
+    TEST_ASSERT( abs_max( r.m_vt.matmul(v) ).allclose(1.0, 1e-8) );
+    TEST_ASSERT( randomized_svd(low_rank, 5).m_s.allclose(s, 1e-8) );
+    
+    // principal components of shifted data equal singular vectors of the centered data
+    tensor<double> x = low_rank + tensor<double>::linspace(100, 200, 120).insertAxis(0,1);
+    pca_result<double> p = pca(x, 4);
+    tensor<double> centered = x - (x.sum(0)/300.0).insertAxis(0,1);
+    svd_decomposition<double> c = svd(centered);
+    TEST_ASSERT( p.m_mean.allclose( x.sum(0)/300.0, 1e-9 ) );
+    TEST_ASSERT( p.m_explained_variance.allclose( (c.m_s*c.m_s/299.0).cropAxis(0, 0, 4), 1e-6 ) );
+    TEST_ASSERT( abs_max( p.m_components.matmul( c.m_vt.cropAxis(0, 0, 4).transpose() ) ).allclose(1.0, 1e-8) );
+}
+
+DECLARE_TEST(Tensor_conv2d)
+{
+    // straightforward NCHW convolution
+    auto reference = [](const tensor<float>& x, const tensor<float>& w, const conv2d_params& p, const tensor_shape& out_shape)
+    {
+        tensor<float> res( out_shape, initializer(0.0f) );
+        int cg = w.shape[1], og = w.shape[0]/p.m_groups;
+        for(int n=0; n<out_shape[0]; ++n)
+            for(int o=0; o<out_shape[1]; ++o)
+                for(int oh=0; oh<out_shape[2]; ++oh)
+                    for(int ow=0; ow<out_shape[3]; ++ow)
+                        for(int c=0; c<cg; ++c)
+                            for(int kh=0; kh<w.shape[2]; ++kh)
+                                for(int kw=0; kw<w.shape[3]; ++kw)
+                                {
+                                    int ih = oh*p.m_stride_h - p.m_pad_h + kh*p.m_dilation_h;
+                                    int iw = ow*p.m_stride_w - p.m_pad_w + kw*p.m_dilation_w;
+                                    if (ih<0 || iw<0 || ih>=x.shape[2] || iw>=x.shape[3]) continue;
+                                    res[{n,o,oh,ow}] += w[{o,c,kh,kw}]*x[{n, (o/og)*cg + c, ih, iw}];
+                                }
+        return res;
+    };
+    
+    tensor<float> x = tensor<float>::random({2,6,11,13}, -1, 1);
+    
+    conv2d_params p;
+    p.m_stride_h = 2;
+    p.m_dilation_w = 2;
+    p.m_pad_h = 1;
+    p.m_pad_w = 2;
+    
+    for(int groups : {1, 2, 3, 6})
+    {
+        p.m_groups = groups;
+        tensor<float> w = tensor<float>::random({6, 6/groups, 3, 2}, -1, 1);
+        
+        p.m_layout = KLayoutNCHW;
+        p.m_algorithm = KConvDirect;
+        tensor<float> direct = conv2d(x, w, p);
+        TEST_ASSERT( direct.shape == tensor_shape({2,6,6,15}) );
+        TEST_ASSERT( direct.allclose( reference(x, w, p, direct.shape.copyShape()), 1e-5f ) );
+        
+        p.m_algorithm = KConvIm2col;
+        TEST_ASSERT( conv2d(x, w, p).allclose(direct, 1e-5f) );
+        
+        // NHWC input is a permuted view, no copy is needed
+        p.m_layout = KLayoutNHWC;
+        tensor<float> xhwc = x.permute({0,2,3,1});
+        for(conv_algorithm a : {KConvDirect, KConvIm2col, KConvAuto})
+        {
+            p.m_algorithm = a;
+            TEST_ASSERT( conv2d(xhwc, w, p).permute({0,3,1,2}).allclose(direct, 1e-5f) );
+            TEST_ASSERT( conv2d(xhwc.contiguous(), w, p).permute({0,3,1,2}).allclose(direct, 1e-5f) );
+        }
+    }
+}
+
+DECLARE_TEST(Tensor_einsum)
+{
+    tensor<double> a = tensor<double>::random({4,5,6}, -1, 1);
+    tensor<double> b = tensor<double>::random({4,6,3}, -1, 1);
+    TEST_ASSERT( einsum("bij,bjk->bik", a, b).allclose( a.matmul(b), 1e-12 ) );
+    TEST_ASSERT( einsum("bij,jk->bik", a, b.subtensor({0})).allclose( a.matmul(b.subtensor({0}).insertAxis(0, 4)), 1e-12 ) );
+    TEST_ASSERT( einsum("bij,bkj->bki", a, b.permute({0,2,1})).allclose( a.matmul(b).permute({0,2,1}), 1e-12 ) );
+    
+    tensor<double> m = tensor<double>::arange(16).reshape({4,4});
+    TEST_ASSERT( einsum("ij->ji", m) == m.transpose() );
+    TEST_ASSERT( einsum("ii->i", m) == tensor<double>::array({0, 5, 10, 15}) );
+    TEST_ASSERT( einsum("ii", m).allclose(30.0) );
+    TEST_ASSERT( einsum("ij,ij->", m, m).allclose( (m*m).sum() ) );
+    TEST_ASSERT( einsum("ij,ij->i", m, m).allclose( (m*m).sum(1) ) );
+    TEST_ASSERT( einsum("i,j", m.subtensor({1}), m.subtensor({2})).allclose( m.subtensor({1}).insertAxis(1,1).matmul( m.subtensor({2}).insertAxis(0,1) ) ) );
+    
+    // three operands with a label summed inside the first one
+    tensor<double> x = tensor<double>::random({3,4,5}, -1, 1);
+    tensor<double> y = tensor<double>::random({4,2}, -1, 1);
+    tensor<double> z = tensor<double>::random({2,5}, -1, 1);
+    tensor<double> expected( {3}, initializer(0.0) );
+    for(int i=0; i<3; ++i) for(int j=0; j<4; ++j) for(int k=0; k<5; ++k) for(int l=0; l<2; ++l)
+    {
+        expected[{i}] += x[{i,j,k}]*y[{j,l}]*z[{l,k}];
+    }
+    TEST_ASSERT( einsum("ijk,jl,lk->i", x, y, z).allclose(expected, 1e-12) );
+    
+    // the chain is evaluated from the cheap end
+    tensor_einsum::label_sizes sizes { {'i',100}, {'j',100}, {'k',100}, {'l',2} };
+    auto order = tensor_einsum::contractionOrder({"ij", "jk", "kl"}, "il", sizes);
+    TEST_ASSERT( order.size()==2 && order[0]==std::make_pair(1,2) );
+    
+    tensor<double> c1 = tensor<double>::random({100,100}, -1, 1);
+    tensor<double> c2 = tensor<double>::random({100,100}, -1, 1);
+    tensor<double> c3 = tensor<double>::random({100,2}, -1, 1);
+    TEST_ASSERT( einsum("ij,jk,kl->il", c1, c2, c3).allclose( c1.matmul(c2).matmul(c3), 1e-10 ) );
+}
+
+DECLARE_TEST(Tensor_sparse)
+{
+    tensor<double> dense = tensor<double>::random({50,40}, -1, 1);
+    dense.apply( [](double& v) { if (v<0.8) v = 0; } );
+    dense.subtensor({7}) = 0.5;    // one dense row
+    
+    csr_matrix<double> a = csr_matrix<double>::fromDense(dense);
+    TEST_ASSERT( a.toDense() == dense );
+    TEST_ASSERT( csr_matrix<double>::fromDense(dense.transpose()).toDense() == dense.transpose() );
+    
+    tensor<double> x = tensor<double>::random({40}, -1, 1);
+    tensor<double> y = tensor<double>::random({40,7}, -1, 1);
+    TEST_ASSERT( a.multiply(x).allclose( dense.matmul(x.insertAxis(1,1)).destroyAxis(1), 1e-12 ) );
+    TEST_ASSERT( a.multiply(y).allclose( dense.matmul(y), 1e-12 ) );
+    TEST_ASSERT( a.multiply(y.transpose().contiguous().transpose()).allclose( dense.matmul(y), 1e-12 ) );
+    
+    tensor<double> weights = tensor<double>::random({50,40}, -1, 1);
+    TEST_ASSERT( a.mask(weights).toDense().allclose( dense*weights, 1e-12 ) );
+    
+    // the dense row does not unbalance the partition
+    for(int parts : {1, 2, 3, 8})
+    {
+        TEST_ASSERT( a.partitionRow(0, parts)==0 && a.partitionRow(parts, parts)==50 );
+        for(int p=0; p<parts; ++p) TEST_ASSERT( a.partitionRow(p, parts) <= a.partitionRow(p+1, parts) );
+    }
+    
+    // duplicates of COO are summed, columns get sorted
+    coo_matrix<float> coo(3, 4);
+    coo.add(2, 3, 1.0f);
+    coo.add(0, 1, 2.0f);
+    coo.add(2, 0, 3.0f);
+    coo.add(0, 1, 4.0f);
+    csr_matrix<float> b = csr_matrix<float>::fromCOO(coo);
+    TEST_ASSERT( b.nnz()==3 );
+    TEST_ASSERT( b.m_row_ptr == std::vector<tensor_settings::index_type>({0, 1, 1, 3}) );
+    TEST_ASSERT( b.m_col == std::vector<tensor_settings::index_type>({1, 0, 3}) );
+    TEST_ASSERT( b.toDense() == tensor<float>({3,4}, {0,6,0,0, 0,0,0,0, 3,0,0,1}) );
+    TEST_ASSERT( csr_matrix<float>::fromCOO(b.toCOO()).toDense() == b.toDense() );
+}
+
+DECLARE_TEST(Tensor_FunctionalInitialization_DynamicStaticCast)
+{
+    tensor<double> q_1 = tensor<double>::identity(40);
+    
+    tensor<double,40,40> q_2([](int i, int j){return i==j?1:0;});
+    TEST_ASSERT(q_2 == (tensor<double,40,40>::identity()));
+    TEST_ASSERT(q_2.isIdentity());
+    
+    TEST_ASSERT(q_1 == tensor<double>(q_2));
+    TEST_ASSERT((tensor<double,40,40>(q_1) == q_2));
+}
+
+DECLARE_TEST(Tensor_fixed_size)
+{
+    static_assert(sizeof(tensor<float,4,4>) == 16*sizeof(float));
+    static_assert(alignof(tensor<float,4,4>) == 32);
+    
+    tensor<double,3,3> m3 { 2, -1, 0,  1, 3, 2,  0, 1, 4 };
+    TEST_ASSERT( std::abs(m3.det() - 24) < 1e-12 );
+    TEST_ASSERT( (m3*m3.inverse()).isIdentity(1e-12) );
+    
+    auto check = [](auto m)
+    {
+        tensor<double> d = m;
+        TEST_ASSERT( std::abs(det(m) - det(d)) < 1e-10 );
+        TEST_ASSERT( tensor<double>(inverse(m)).allclose( inverse(d), 1e-10 ) );
+        TEST_ASSERT( (m*m.inverse()).isIdentity(1e-10) );
+        TEST_ASSERT( tensor<double>(m*m.transpose()).allclose( d.matmul(d.transpose()), 1e-12 ) );
+    };
+    check( tensor<double,2,2>::random(0, 1) );
+    check( tensor<double,3,3>::random(0, 1) );
+    check( tensor<double,4,4>::random(0, 1) );
+    check( tensor<double,6,6>::random(0, 1) );
+    
+    tensor<double,3> v { 1, 2, 3 };
+    TEST_ASSERT( ((m3*v) == tensor<double,3>{ 0, 13, 14 }) );
+    TEST_ASSERT( v.dot(v) == 14 );
+    
+    // affine 3D transform of points in AoS and SoA layouts
+    tensor<float,4,4> t { 0, -1, 0, 10,
+                          1,  0, 0, 20,
+                          0,  0, 2, 30,
+                          0,  0, 0, 1 };
+    tensor<float> points = tensor<float>::random({1000, 3}, -1, 1);
+    tensor<float> homogeneous = tensor<float>::cat({ points, tensor<float>({1000, 1}, initializer(1.0f)) }, 1);
+    
+    tensor<float> expected = homogeneous.matmul( tensor<float>(t).transpose() );
+    tensor<float> aos = transform_points(t, points);
+    TEST_ASSERT( aos.shape == tensor_shape({1000, 3}) );
+    TEST_ASSERT( aos.allclose( expected.cropAxis(1, 0, 3), 1e-5f ) );
+    TEST_ASSERT( transform_points(t, homogeneous).allclose( expected, 1e-5f ) );
+    
+    tensor<float> soa = transform_points_soa(t, points.transpose().contiguous());
+    TEST_ASSERT( soa.allclose( aos.transpose(), 1e-5f ) );
+    TEST_ASSERT( transform_points_soa(t, points.transpose()).allclose( aos.transpose(), 1e-5f ) );
+}
+
+DECLARE_TEST(Tensor_reduce_axes)
+{
+    tensor<double> t = tensor<double>::random({6,50,7,40}, 0.5, 1.5);
+    
+    tensor<double> expected( {50,40}, initializer(0.0) );
+    tensor<double> expected_max( {50,40}, initializer(0.0) );
+    for(int i=0; i<6; ++i) for(int j=0; j<50; ++j) for(int k=0; k<7; ++k) for(int l=0; l<40; ++l)
+    {
+        expected[{j,l}] += t[{i,j,k,l}];
+        expected_max[{j,l}] = std::max(expected_max[{j,l}], t[{i,j,k,l}]);
+    }
+    
+    TEST_ASSERT( t.sum({0,2}).allclose(expected, 1e-10) );
+    TEST_ASSERT( t.sum({2,-4}).allclose(expected, 1e-10) );
+    TEST_ASSERT( t.max({0,2}) == expected_max );
+    TEST_ASSERT( t.mean({0,2}).allclose(expected/42.0, 1e-12) );
+    TEST_ASSERT( t.sum({0,2}, true).shape == tensor_shape({1,50,1,40}) );
+    TEST_ASSERT( t.sum({0,2}, true).reshape({50,40}).allclose(expected, 1e-10) );
+    
+    // strided input and preallocated output
+    tensor<double> out({40,50});
+    tensor<double> res = t.permute({3,1,0,2}).sum({2,3}, false, out);
+    TEST_ASSERT( res.data()==out.data() );
+    TEST_ASSERT( out.allclose(expected.transpose(), 1e-10) );
+    tensor<double> out_t = tensor<double>({40,50}).transpose();
+    TEST_ASSERT( t.sum({0,2}, false, out_t).data()==out_t.data() );
+    TEST_ASSERT( out_t.allclose(expected, 1e-10) );
+    
+    // full reductions
+    TEST_ASSERT( t.sum(std::vector<int>{}).allclose( tensor<double>::scalar(t.sum()), 1e-8 ) );
+    TEST_ASSERT( t.max(std::vector<int>{}) == tensor<double>::scalar(t.max()) );
+    TEST_ASSERT( t.min({0,1,2,3}, true).shape == tensor_shape({1,1,1,1}) );
+    TEST_ASSERT( t.min({0,1,2,3}, true).reshape({1}) == tensor<double>::array({t.min()}) );
+    
+    tensor<float> small = tensor<float>::matrix({ {1, 2, 3}, {4, 5, 6} });
+    TEST_ASSERT( small.prod({1}) == tensor<float>::array({6, 120}) );
+    TEST_ASSERT( small.prod({0}) == tensor<float>::array({4, 10, 18}) );
+    TEST_ASSERT( small.sum<double>({0,1}).allclose(21.0) );
+}
+
+DECLARE_TEST(Tensor_argmax)
+{
+    tensor<float> test = tensor<float>::matrix({ {3, 7, 1, 7},
+                                                 {4, 2, 5, 0},
+                                                 {4, 2, 0, 0} } );
+    
+    // ties resolve to the first index
+    TEST_ASSERT( test.argmax(1) == tensor<int>::array({1, 2, 0}) );
+    TEST_ASSERT( test.argmin(1) == tensor<int>::array({2, 3, 2}) );
+    TEST_ASSERT( test.argmax(0) == tensor<int>::array({1, 0, 1, 0}) );
+    TEST_ASSERT( test.argmin(0) == tensor<int>::array({0, 1, 2, 1}) );
+    TEST_ASSERT( test.transpose().contiguous().argmax(0) == tensor<int>::array({1, 2, 0}) );
+    TEST_ASSERT( test.argmax(-1) == test.transpose().argmax(0) );
+    
+    auto vi = test.max_with_index(1);
+    TEST_ASSERT( vi.first == test.max(1) );
+    TEST_ASSERT( vi.second == test.argmax(1) );
+    
+    tensor<double> t = tensor<double>::random({20,30,40}, -1, 1);
+    for(int axis=0; axis<3; ++axis)
+    {
+        tensor<int> index = t.argmax(axis);
+        tensor<double> m = t.max(axis);
+        bool ok = true;
+        for(int i=0; i<index.shape[0]; ++i) for(int j=0; j<index.shape[1]; ++j)
+        {
+            tensor_index pos = axis==0 ? tensor_index{index[{i,j}], i, j} :
+                               axis==1 ? tensor_index{i, index[{i,j}], j} : tensor_index{i, j, index[{i,j}]};
+            ok = ok && t[pos]==m[{i,j}];
+        }
+        TEST_ASSERT(ok);
+        TEST_ASSERT( t.min_with_index(axis).first == t.min(axis) );
+    }
+    
+    // a long axis 0 with few (and with enough to split between threads) columns matches the scan of lines
+    for(int columns : {4, 64})
+    {
+        tensor<float> tall = tensor<float>::random({200000/columns*4, columns}, 0, 1);
+        const tensor<float> lines = tall.transpose().contiguous();
+        TEST_ASSERT( tall.argmax(0) == lines.argmax(1) );
+        TEST_ASSERT( tall.argmin(0) == lines.argmin(1) );
+    }
+}
+
+DECLARE_TEST(Tensor_log_softmax)
+{
+    auto map = [](const vtensor<double>& x, double (*f)(double))
+    {
+        tensor<double> r = x.deepCopy();
+        r.apply( [f](double& v) { v = f(v); } );
+        return r;
+    };
+    
+    tensor<double> t = tensor<double>::random({5,300,7}, -50, 50);
+    t[{1,2,3}] = 800;   // exp overflows without the max shift
+    const tensor<double> original = t.deepCopy();
+    
+    for(int axis=0; axis<3; ++axis)
+    {
+        tensor<double> m = t.max(axis);
+        tensor<double> reference = m + map( map(t - m.insertAxis(axis, t.shape[axis]), exp).sum(axis), log );
+        TEST_ASSERT( t.logsumexp(axis).allclose(reference, 1e-9) );
+        
+        tensor<double> s = t.softmax(axis);
+        TEST_ASSERT( s.sum(axis).allclose(1.0, 1e-12) );
+        TEST_ASSERT( map(t.log_softmax(axis), exp).allclose(s, 1e-12) );
+        
+        tensor<double> in_place = t.deepCopy();
+        in_place.softmax_inplace(axis);
+        TEST_ASSERT( in_place.allclose(s, 1e-15) );
+        in_place = t.deepCopy();
+        in_place.log_softmax_inplace(axis);
+        TEST_ASSERT( in_place.allclose(t.log_softmax(axis), 1e-15) );
+        
+        // the input is not modified along any axis
+        TEST_ASSERT( t == original );
+    }
+    
+    // strided lines and a single long line
+    TEST_ASSERT( t.permute({2,0,1}).logsumexp(2).allclose( t.logsumexp(1).transpose(), 1e-9 ) );
+    tensor<double> line = tensor<double>::linspace(-10, 10, 10000);
+    TEST_ASSERT( line.softmax(0).sum(0).allclose(1.0, 1e-12) );
+    TEST_ASSERT( line.logsumexp(0).allclose( line.max() + log( map(line - line.max(), exp).sum() ), 1e-9 ) );
+    
+    // a long axis 0 with few (and with enough to split between threads) columns matches the scan of lines
+    for(int columns : {4, 64})
+    {
+        tensor<double> tall = tensor<double>::random({200000/columns*4, columns}, -50, 50);
+        const tensor<double> lines = tall.transpose().contiguous();
+        TEST_ASSERT( tall.logsumexp(0).allclose( lines.logsumexp(1), 1e-9 ) );
+        TEST_ASSERT( tall.softmax(0).allclose( lines.softmax(1).transpose(), 1e-12 ) );
+    }
+}
+
+DECLARE_TEST(Tensor_moments)
+{
+    // values far from zero lose precision in the naive sum of squares
+    tensor<double> t = tensor<double>::random({30,200,9}, 1e6, 1e6+1);
+    
+    for(const std::vector<int>& axes : std::vector< std::vector<int> >{ {0}, {1}, {0,2}, {} })
+    {
+        tensor<double> mean = t.mean(axes, true);
+        tensor<double> d = t - mean.upshape(t.shape.copyShape());
+        tensor<double> var = (d*d).mean(axes);
+        
+        auto m = t.moments(axes);
+        TEST_ASSERT( m.first.allclose(t.mean(axes), 1e-6) );
+        TEST_ASSERT( m.second.allclose(var, 1e-9) );
+        TEST_ASSERT( t.var(axes, false, 1).allclose( var*double(d.numElements()/var.numElements())/double(d.numElements()/var.numElements() - 1), 1e-9 ) );
+        tensor<double> sd = t.std(axes, true);
+        TEST_ASSERT( (sd*sd).allclose( var.reshape(sd.shape.copyShape()), 1e-9 ) );
+    }
+    
+    // Chan's merge of partial states
+    welford_state<double> a, b, all;
+    for(int i=0; i<10; ++i) { a.add(i); all.add(i); }
+    for(int i=10; i<25; ++i) { b.add(i*i); all.add(i*i); }
+    a.merge(b);
+    TEST_ASSERT( a.m_n==25 && std::abs(a.m_mean-all.m_mean)<1e-12 && std::abs(a.m_m2-all.m_m2)<1e-8 );
+    
+    // half values are accumulated in float
+    tensor<half> h({4096});
+    h.apply( [](half& v) { v = half(1000); } );
+    h[{0}] = half(1008);
+    auto hm = h.moments({0});
+    TEST_ASSERT( std::abs(float(*hm.first.data()) - (1000 + 8.0f/4096)) < 0.5f );
+    TEST_ASSERT( float(*hm.second.data()) > 0 );
+}
+
+DECLARE_TEST(Tensor_cumsum)
+{
+    tensor<double> t = tensor<double>::random({4,5,6}, 0.5, 1.5);
+    for(int axis=0; axis<3; ++axis)
+    {
+        tensor<double> s = t.cumsum(axis), p = t.cumprod(axis), mx = t.cummax(axis), mn = t.cummin(axis);
+        bool ok = true;
+        for(int k=0; k<t.shape[axis]; ++k)
+        {
+            tensor<double> prefix = t.cropAxis(axis, 0, k+1);
+            ok = ok && s.destroyAxis(axis, k).allclose( prefix.sum(axis), 1e-12 );
+            ok = ok && p.destroyAxis(axis, k).allclose( prefix.prod({axis}), 1e-12 );
+            ok = ok && mx.destroyAxis(axis, k) == prefix.max(axis);
+            ok = ok && mn.destroyAxis(axis, k) == prefix.min(axis);
+        }
+        TEST_ASSERT(ok);
+    }
+    TEST_ASSERT( t.transpose(0, 2).cumsum(2).allclose( t.cumsum(0).transpose(0, 2), 1e-12 ) );
+    TEST_ASSERT( (tensor<int>::array({3, 1, 4, 1, 5, 9, 2, 6}).cumsum(0) == tensor<int>::array({3, 4, 8, 9, 14, 23, 25, 31})) );
+    
+    // a long line is scanned by blocks in parallel
+    tensor<int> ones( {200000}, initializer(1) );
+    TEST_ASSERT( ones.cumsum(0) == tensor<int>::arange(200000) + 1 );
+    tensor<int> saw = tensor<int>::arange(200000);
+    saw.apply( [](int& v) { v = v % 1000; } );
+    tensor<int> running_max = saw.cummax(0);
+    TEST_ASSERT( running_max.max()==999 && running_max[{998}]==998 && running_max[{150000}]==999 );
+    
+    // a long axis 0 with few (and with enough to split between threads) columns matches the scan of lines
+    for(int columns : {4, 64})
+    {
+        tensor<int> tall = tensor<int>::arange(200000*4).reshape({200000/columns*4, columns});
+        tall.apply( [](int& v) { v = v % 7 - 3; } );
+        const tensor<int> lines = tall.transpose().contiguous();
+        TEST_ASSERT( tall.cumsum(0) == lines.cumsum(1).transpose() );
+        TEST_ASSERT( tall.cummax(0) == lines.cummax(1).transpose() );
+    }
+}
+
+DECLARE_TEST(Tensor_topk)
+{
+    tensor<float> test = tensor<float>::matrix({ {3, 7, 1, 7, 2},
+                                                 {4, 2, 5, 0, 5} } );
+    topk_result<float> r = topk(test, 2);
+    TEST_ASSERT( r.m_values == tensor<float>::matrix({ {7, 7}, {5, 5} }) );
+    TEST_ASSERT( r.m_indices == tensor<int>::matrix({ {1, 3}, {2, 4} }) );
+    
+    r = topk(test, 3, 1, false);
+    TEST_ASSERT( r.m_values == tensor<float>::matrix({ {1, 2, 3}, {0, 2, 4} }) );
+    TEST_ASSERT( r.m_indices == tensor<int>::matrix({ {2, 4, 0}, {3, 1, 0} }) );
+    
+    r = topk(test, 1, 0);
+    TEST_ASSERT( r.m_values == tensor<float>::matrix({ {4, 7, 5, 7, 5} }) );
+    TEST_ASSERT( r.m_indices == tensor<int>::matrix({ {1, 0, 1, 0, 1} }) );
+    
+    // heap (small k) and quickselect (large k) agree with a full sort
+    tensor<double> t = tensor<double>::random({30, 500}, 0, 1);
+    for(int k : {1, 10, 62, 63, 300, 500})
+    {
+        topk_result<double> a = topk(t, k);
+        topk_result<double> b = topk(t.transpose(), k, 0, true);
+        bool ok = a.m_values == b.m_values.transpose() && a.m_indices == b.m_indices.transpose();
+        for(int row=0; row<30; ++row)
+        {
+            std::vector<double> line( t.data() + row*500, t.data() + row*500 + 500 );
+            std::sort( line.begin(), line.end(), std::greater<double>() );
+            for(int i=0; i<k; ++i)
+            {
+                ok = ok && a.m_values[{row, i}]==line[i];
+                ok = ok && t[{row, a.m_indices[{row, i}]}]==line[i];
+            }
+        }
+        TEST_ASSERT(ok);
+        
+        topk_result<double> unsorted = topk(t, k, -1, true, false);
+        TEST_ASSERT( unsorted.m_values.sum(1).allclose( a.m_values.sum(1), 1e-9 ) );
+    }
+}
+
+DECLARE_TEST(Tensor_sort)
+{
+    tensor<float> test = tensor<float>::matrix({ {3, 7, 1, 7, 2},
+                                                 {4, 2, 5, 0, 5} } );
+    TEST_ASSERT( sort(test) == tensor<float>::matrix({ {1, 2, 3, 7, 7}, {0, 2, 4, 5, 5} }) );
+    TEST_ASSERT( argsort(test, -1, false, true) == tensor<int>::matrix({ {2, 4, 0, 1, 3}, {3, 1, 0, 2, 4} }) );
+    TEST_ASSERT( argsort(test, -1, true, true) == tensor<int>::matrix({ {1, 3, 0, 4, 2}, {2, 4, 0, 1, 3} }) );
+    TEST_ASSERT( sort(test, 0, true) == tensor<float>::matrix({ {4, 7, 5, 7, 5}, {3, 2, 1, 0, 2} }) );
+    
+    // radix sort of long lines (parallel merge for a single line) agrees with a stable comparison sort
+    tensor<float> t = tensor<float>::random({3, 1<<17}, -100, 100);
+    tensor<int> ti = t.astype<int>();
+    for(int row=0; row<3; ++row)
+    {
+        tensor<float> line = t.cropAxis(0, row, row+1);
+        std::vector< std::pair<int, int> > ref;
+        for(int i=0; i<(1<<17); ++i) ref.push_back( { ti[{row, i}], i } );
+        std::stable_sort( ref.begin(), ref.end(), [](auto& a, auto& b) { return a.first > b.first; } );
+        
+        std::vector<float> values( line.data(), line.data() + (1<<17) );
+        std::sort( values.begin(), values.end() );
+        
+        tensor<int> order = argsort(ti.cropAxis(0, row, row+1), -1, true, true);
+        tensor<float> sorted = sort(line);
+        bool ok = true;
+        for(int i=0; i<(1<<17); ++i)
+        {
+            ok = ok && order[{0, i}]==ref[i].second && sorted[{0, i}]==values[i];
+        }
+        TEST_ASSERT(ok);
+    }
+    
+    // strided lines and comparison sort of short lines
+    tensor<double> d = tensor<double>::random({200, 7}, -1, 1);
+    TEST_ASSERT( sort(d.transpose(), 1) == sort(d, 0).transpose() );
+    TEST_ASSERT( argsort(d, 1, false, true) == argsort(d, 1) );
+}
+
+DECLARE_TEST(Tensor_histogram)
+{
+    tensor<float> test = tensor<float>::matrix({ {0.f, 0.5f, 1.f, 2.5f, 4.f},
+                                                 {-1.f, 3.9f, 2.f, 5.f, 1.5f} } );
+    histogram_result<int> h = histogram(test, 4, 0, 4);
+    TEST_ASSERT( h.m_counts == tensor<int>::array({2, 2, 2, 2}) );
+    TEST_ASSERT( h.m_edges == tensor<double>::array({0, 1, 2, 3, 4}) );
+    TEST_ASSERT( histogram(test, 2).m_counts == tensor<int>::array({5, 5}) );
+    
+    tensor<float> weights = tensor<float>::matrix({ {1, 2, 3, 4, 5}, {6, 7, 8, 9, 10} });
+    TEST_ASSERT( histogram(test, weights, 4, 0, 4).m_counts == tensor<float>::array({3, 13, 12, 12}) );
+    
+    tensor<int> labels = tensor<int>::matrix({ {0, 3, 3, 1}, {0, 3, 5, 3} });
+    TEST_ASSERT( bincount(labels) == tensor<int>::array({2, 1, 0, 4, 0, 1}) );
+    TEST_ASSERT( bincount(labels, 8) == tensor<int>::array({2, 1, 0, 4, 0, 1, 0, 0}) );
+    TEST_ASSERT( bincount(labels, labels.astype<double>()) == tensor<double>::array({0, 1, 0, 12, 0, 5}) );
+    
+    // private bins of threads over strided data agree with a serial count
+    tensor<double> t = tensor<double>::random({300, 400}, -1, 1);
+    histogram_result<int> ht = histogram(t.transpose(), 32, -1, 1);
+    std::vector<int> ref(32, 0);
+    t.apply( [&ref](const double& v) { ++ref[ std::min(31, int((v+1)*16)) ]; } );
+    bool ok = true;
+    for(int b=0; b<32; ++b) ok = ok && ht.m_counts[{b}]==ref[b];
+    TEST_ASSERT(ok);
+    TEST_ASSERT( bincount( ((t+1)*16).astype<int>() )[{31}] == ref[31] );
+    TEST_ASSERT( histogram(t.reshape({120000}), 32, -1, 1).m_counts == ht.m_counts );
+}
+
+DECLARE_TEST(Tensor_cdist)
+{
+    tensor<double> test = tensor<double>::matrix({ {3, -4, 0}, {1, 2, 2} });
+    TEST_ASSERT( test.norm(1) == tensor<double>::array({5, 3}) );
+    TEST_ASSERT( test.norm(1, 1) == tensor<double>::array({7, 5}) );
+    TEST_ASSERT( test.norm(0, std::numeric_limits<double>::infinity()) == tensor<double>::array({3, 4, 2}) );
+    TEST_ASSERT( test.norm(1, 0) == tensor<double>::array({2, 3}) );
+    TEST_ASSERT( test.norm(1, 3).allclose( tensor<double>::array({pow(91., 1/3.), pow(17., 1/3.)}), 1e-12 ) );
+    TEST_ASSERT( test.norm({}, 2, true) == tensor<double>::matrix({ {sqrt(34.)} }) );
+    
+    // blocked distances agree with pairs of broadcast rows
+    tensor<double> a = tensor<double>::random({70, 45}, -1, 1), b = tensor<double>::random({45, 90}, -1, 1);
+    tensor<double> bt = b.transpose();
+    std::vector<int> all;
+    tensor<double> l1 = cdist(a, bt, KDistanceL1), l2 = cdist(a, bt), sq = cdist(a, bt, KDistanceSquaredL2);
+    tensor<double> cosine = cdist(a, bt, KDistanceCosine), ip = cdist(a, bt, KDistanceInnerProduct);
+    bool ok = true;
+    for(int i=0; i<70; ++i)
+    {
+        for(int j=0; j<90; ++j)
+        {
+            tensor<double> x = a.cropAxis(0, i, i+1), y = bt.cropAxis(0, j, j+1);
+            tensor<double> diff = x - y;
+            double dot = (x*y).sum(), nx = x.norm(all).item(), ny = y.norm(all).item();
+            ok = ok && std::abs( l1[{i, j}] - diff.norm(all, 1).item() ) < 1e-10;
+            ok = ok && std::abs( l2[{i, j}] - diff.norm(all).item() ) < 1e-10;
+            ok = ok && std::abs( sq[{i, j}] - (diff*diff).sum() ) < 1e-10;
+            ok = ok && std::abs( ip[{i, j}] - dot ) < 1e-10;
+            ok = ok && std::abs( cosine[{i, j}] - (1 - dot/(nx*ny)) ) < 1e-10;
+        }
+    }
+    TEST_ASSERT(ok);
+}
+
+DECLARE_TEST(Tensor_any_all)
+{
+    tensor<float> test = tensor<float>::matrix({ {0, 2, 0, 1},
+                                                 {0, 0, 0, 3},
+                                                 {0, 5, 6, 7} } );
+    TEST_ASSERT( test.any() && !test.all() );
+    TEST_ASSERT( test.any_of( [](float v) { return v > 6; } ) && !test.any_of( [](float v) { return v != v; } ) );
+    TEST_ASSERT( test.all_of( [](float v) { return v >= 0 && v <= 7; } ) );
+    TEST_ASSERT( test.any({0}) == tensor<bool>::array({false, true, true, true}) );
+    TEST_ASSERT( test.all({1}, true) == tensor<bool>::matrix({ {false}, {false}, {false} }) );
+    TEST_ASSERT( test.cropAxis(1, 1, 4).all({1}) == tensor<bool>::array({false, false, true}) );
+    TEST_ASSERT( test.any({0, 1}, true) == tensor<bool>::matrix({ {true} }) );
+    TEST_ASSERT( test.count_nonzero({0}) == tensor<int>::array({0, 2, 1, 3}) );
+    TEST_ASSERT( test.count_nonzero() == 6 );
+    
+    TEST_ASSERT( test.nonzero() == tensor<int>::matrix({ {0, 1}, {0, 3}, {1, 3}, {2, 1}, {2, 2}, {2, 3} }) );
+    TEST_ASSERT( test.transpose().nonzero() == tensor<int>::matrix({ {1, 0}, {1, 2}, {2, 2}, {3, 0}, {3, 1}, {3, 2} }) );
+    TEST_ASSERT( test.masked_select(test) == tensor<float>::array({2, 1, 3, 5, 6, 7}) );
+    TEST_ASSERT( test.masked_select( tensor<int>::array({1, 0, 1}) ) == tensor<float>::array({0, 2, 0, 1, 0, 5, 6, 7}) );
+    
+    // early exit and compaction of parts in parallel
+    tensor<double> t = tensor<double>::random({500, 300}, -1, 1);
+    t[{400, 7}] = 2;
+    TEST_ASSERT( t.any_of( [](double v) { return v > 1; } ) && !t.transpose().all_of( [](double v) { return v <= 1; } ) );
+    TEST_ASSERT( !t.reshape({150000}).cropAxis(0, 0, 120000).any_of( [](double v) { return v > 1; } ) );
+    tensor<bool> positive( t.shape.copyShape() );
+    positive.apply(t, [](bool& p, const double& v) { p = v > 0; });
+    tensor<double> selected = t.masked_select(positive);
+    tensor<int> indices = positive.nonzero();
+    TEST_ASSERT( selected.shape[0] == positive.count_nonzero() && indices.shape[0] == selected.shape[0] );
+    bool ok = true;
+    for(int i=0; i<selected.shape[0]; ++i)
+    {
+        ok = ok && t[{indices[{i, 0}], indices[{i, 1}]}] == selected[{i}];
+        ok = ok && (i==0 || indices[{i-1, 0}]*300 + indices[{i-1, 1}] < indices[{i, 0}]*300 + indices[{i, 1}]);
+    }
+    TEST_ASSERT(ok);
+}
+
 #if 0
 DECLARE_TEST(Tensor_some_test)
 {
@@ -419,48 +1380,6 @@ DECLARE_TEST(Tensor_SliceTest)
     TEST_ASSERT( tensor<double>( slice(m6).from(2,2).withSize(1,1) )==m11 );
 }
 
-DECLARE_TEST(Tensor_Invert200x200_Random0_1)
-{
-    const int n = 200;
-    auto m = tensor<double, n, n>::random(0,1);
-    tensor<double, n, n> r;
-    invert_with_LU_decomposition(r, m);
-    
-    auto mres = m*r;
-    TEST_ASSERT(mres.isIdentity(0.001));
-}
-
-DECLARE_TEST(Tensor_FunctionalInitialization_DynamicStaticCast)
-{
-    tensor<double> q_1(40,40, [](int i, int j){return i==j?1:0;});
-    ASSERT(q_1 == tensor<double>::identity(40,40));
-    
-    tensor<double,40,40> q_2([](int i, int j){return i==j?1:0;});
-    ASSERT(q_2 == (tensor<double,40,40>::identity()));
-
-    ASSERT(q_1 == tensor<double>(q_2));
-}
-
-DECLARE_TEST(Vector_InitializerListConstructor_LinearEquation)
-{
-    tensor<float> a = tensor<float>::random(14,14, -10,20);
-    
-    vect<float> v({1,7,2,8,0,6,4,1,7,2,8,0,6,4});
-    vect<float> x = solve(a, v);
-    
-    vect<float> expected = a*x;
-    TEST_ASSERT(sqrLength(expected-v)<0.001);
-}
-
-DECLARE_TEST(Tensor_InitializerListConstructor_FindingDeterminant)
-{
-    tensor<double, 3,3> m33 = {{1, 2, 4}, {3, 4, 1}, {1, -1, -1}};
-    double det1 = det(m33);
-    double determinant2 = determinant(m33);
-    
-    TEST_ASSERT_FLOAT_EQ(det1, determinant2, 0.001);
-}
-
 DECLARE_TEST(upper_multiple)
 {
     TEST_ASSERT(upper_multiple(100,100)==100 );